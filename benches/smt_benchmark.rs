@@ -4,12 +4,138 @@ extern crate criterion;
 use criterion::Criterion;
 use rand::{thread_rng, Rng};
 use restricted_sparse_merkle_tree::{
-    blake2b::Blake2bHasher, default_store::DefaultStore, tree::SparseMerkleTree, H256,
+    arena_store::ArenaStore,
+    blake2b::Blake2bHasher,
+    default_store::DefaultStore,
+    error::Error,
+    traits::Store,
+    tree::{BranchNode, LeafNode, SparseMerkleTree},
+    H256,
 };
+use std::{
+    cell::{Cell, RefCell},
+    env,
+    rc::Rc,
+    time::{Duration, Instant},
+};
+
+const PROOF_KEYS_COUNTS: [usize; 4] = [1, 20, 1_000, 10_000];
+const TREE_SIZES: [usize; 4] = [1_000, 100_000, 1_000_000, 10_000_000];
+const BATCH_SIZE: usize = 1_000;
+const GET_MANY_KEYS: usize = 100;
+
+/// Trees larger than `SMT_BENCH_MAX_LEAVES` are skipped, default is 100_000
+fn tree_sizes() -> Vec<usize> {
+    let max_leaves = env::var("SMT_BENCH_MAX_LEAVES")
+        .ok()
+        .and_then(|max_leaves| max_leaves.parse().ok())
+        .unwrap_or(100_000);
+    TREE_SIZES
+        .iter()
+        .copied()
+        .filter(|size| *size <= max_leaves)
+        .collect()
+}
+
+/// Latency of a read call of `IoStore`, set by `SMT_BENCH_READ_LATENCY_NS`, default is 1µs
+fn read_latency() -> Duration {
+    let nanos = env::var("SMT_BENCH_READ_LATENCY_NS")
+        .ok()
+        .and_then(|nanos| nanos.parse().ok())
+        .unwrap_or(1_000);
+    Duration::from_nanos(nanos)
+}
+
+/// A store simulating a disk backed store
+///
+/// Every read call waits `read_latency` like a round trip to disk,
+/// a batched read waits once. Read calls are counted.
+struct IoStore {
+    inner: DefaultStore<H256>,
+    latency: Duration,
+    reads: Cell<u64>,
+}
 
-const TARGET_LEAVES_COUNT: usize = 20;
+impl Default for IoStore {
+    fn default() -> Self {
+        IoStore {
+            inner: Default::default(),
+            latency: read_latency(),
+            reads: Cell::new(0),
+        }
+    }
+}
 
-type SMT = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>>;
+impl IoStore {
+    fn read(&self) {
+        self.reads.set(self.reads.get() + 1);
+        let start = Instant::now();
+        while start.elapsed() < self.latency {}
+    }
+}
+
+impl Store<H256> for IoStore {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.read();
+        self.inner.get_branch(node)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<H256>>, Error> {
+        self.read();
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        self.read();
+        nodes
+            .iter()
+            .map(|node| self.inner.get_branch(node))
+            .collect()
+    }
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<H256>>>, Error> {
+        self.read();
+        leaf_hashes
+            .iter()
+            .map(|leaf_hash| self.inner.get_leaf(leaf_hash))
+            .collect()
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.inner.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<H256>) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.inner.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+/// Stores of the benchmarks
+trait BenchStore: Store<H256> + Default + 'static {
+    const NAME: &'static str;
+    /// Number of read calls, for stores counting reads
+    fn reads(&self) -> Option<u64> {
+        None
+    }
+}
+
+impl BenchStore for DefaultStore<H256> {
+    const NAME: &'static str = "default store";
+}
+
+impl BenchStore for ArenaStore<H256> {
+    const NAME: &'static str = "arena store";
+}
+
+impl BenchStore for IoStore {
+    const NAME: &'static str = "io store";
+    fn reads(&self) -> Option<u64> {
+        Some(self.reads.get())
+    }
+}
+
+type SMT<S> = SparseMerkleTree<Blake2bHasher, H256, S>;
 
 fn random_h256(rng: &mut impl Rng) -> H256 {
     let mut buf = [0u8; 32];
@@ -17,71 +143,246 @@ fn random_h256(rng: &mut impl Rng) -> H256 {
     buf.into()
 }
 
-fn random_smt(update_count: usize, rng: &mut impl Rng) -> (SMT, Vec<H256>) {
-    let mut smt = SparseMerkleTree::default();
-    let mut keys = Vec::with_capacity(update_count);
-    for _ in 0..update_count {
-        let key = random_h256(rng);
-        let value = random_h256(rng);
-        smt.update(key, value).unwrap();
-        keys.push(key);
-    }
+fn random_leaves(count: usize, rng: &mut impl Rng) -> Vec<(H256, H256)> {
+    (0..count)
+        .map(|_| (random_h256(rng), random_h256(rng)))
+        .collect()
+}
+
+fn random_smt<S: BenchStore>(size: usize, rng: &mut impl Rng) -> (SMT<S>, Vec<H256>) {
+    let mut leaves = random_leaves(size, rng);
+    leaves.sort_unstable_by_key(|(key, _value)| *key);
+    leaves.dedup_by_key(|(key, _value)| *key);
+    let keys = leaves.iter().map(|(key, _value)| *key).collect();
+    let smt = SMT::from_sorted_iter(S::default(), leaves).unwrap();
     (smt, keys)
 }
 
-fn bench(c: &mut Criterion) {
-    c.bench_function_over_inputs(
-        "SMT update",
-        |b, &&size| {
-            b.iter(|| {
+/// Updates of existing keys with random values, the size of the tree is unchanged
+fn random_updates(keys: &[H256], count: usize, rng: &mut impl Rng) -> Vec<(H256, H256)> {
+    (0..count)
+        .map(|_| (keys[rng.gen_range(0, keys.len())], random_h256(rng)))
+        .collect()
+}
+
+/// Print the store reads of one call of f if `SMT_BENCH_REPORT_READS` is set
+fn report_reads<S: BenchStore, F: FnOnce(&mut SMT<S>)>(id: &str, smt: &RefCell<SMT<S>>, f: F) {
+    if env::var_os("SMT_BENCH_REPORT_READS").is_none() {
+        return;
+    }
+    let mut smt = smt.borrow_mut();
+    if let Some(before) = smt.store().reads() {
+        f(&mut smt);
+        let reads = smt.store().reads().unwrap() - before;
+        println!("{}: {} store reads", id, reads);
+    }
+}
+
+fn bench_store<S: BenchStore>(c: &mut Criterion) {
+    for size in tree_sizes() {
+        let mut rng = thread_rng();
+        let (smt, keys) = random_smt::<S>(size, &mut rng);
+        let smt = Rc::new(RefCell::new(smt));
+        let keys = Rc::new(keys);
+
+        let id = format!("{}/get/{}", S::NAME, size);
+        report_reads(&id, &smt, |smt| {
+            smt.get(&keys[0]).unwrap();
+        });
+        c.bench_function(&id, {
+            let (smt, keys) = (Rc::clone(&smt), Rc::clone(&keys));
+            move |b| {
+                let smt = smt.borrow();
                 let mut rng = thread_rng();
-                random_smt(size, &mut rng)
+                b.iter(|| smt.get(&keys[rng.gen_range(0, keys.len())]).unwrap());
+            }
+        });
+
+        // the same keys by get_many and get
+        let get_keys: Vec<H256> = keys.iter().take(GET_MANY_KEYS).copied().collect();
+        let id = format!("{}/get_many {} keys/{}", S::NAME, GET_MANY_KEYS, size);
+        report_reads(&id, &smt, |smt| {
+            smt.get_many(&get_keys).unwrap();
+        });
+        c.bench_function(&id, {
+            let (smt, get_keys) = (Rc::clone(&smt), get_keys.clone());
+            move |b| {
+                let smt = smt.borrow();
+                b.iter(|| smt.get_many(&get_keys).unwrap());
+            }
+        });
+        let id = format!("{}/get {} keys one by one/{}", S::NAME, GET_MANY_KEYS, size);
+        report_reads(&id, &smt, |smt| {
+            for key in &get_keys {
+                smt.get(key).unwrap();
+            }
+        });
+        c.bench_function(&id, {
+            let smt = Rc::clone(&smt);
+            move |b| {
+                let smt = smt.borrow();
+                b.iter(|| {
+                    for key in &get_keys {
+                        smt.get(key).unwrap();
+                    }
+                });
+            }
+        });
+
+        for &keys_count in PROOF_KEYS_COUNTS.iter().filter(|count| **count <= size) {
+            let proof_keys: Vec<H256> = keys.iter().take(keys_count).copied().collect();
+            let id = format!("{}/merkle proof {} keys/{}", S::NAME, keys_count, size);
+            report_reads(&id, &smt, |smt| {
+                smt.merkle_proof(proof_keys.clone()).unwrap();
+            });
+            c.bench_function(&id, {
+                let (smt, proof_keys) = (Rc::clone(&smt), proof_keys.clone());
+                move |b| {
+                    let smt = smt.borrow();
+                    b.iter(|| smt.merkle_proof(proof_keys.clone()).unwrap());
+                }
             });
-        },
-        &[100, 10_000],
-    );
-
-    c.bench_function_over_inputs(
-        "SMT get",
-        |b, &&size| {
-            let mut rng = thread_rng();
-            let (smt, _keys) = random_smt(size, &mut rng);
-            b.iter(|| {
-                let key = random_h256(&mut rng);
-                smt.get(&key).unwrap();
+            let id = format!(
+                "{}/compiled merkle proof {} keys/{}",
+                S::NAME,
+                keys_count,
+                size
+            );
+            c.bench_function(&id, {
+                let smt = Rc::clone(&smt);
+                move |b| {
+                    let smt = smt.borrow();
+                    b.iter(|| smt.compiled_merkle_proof(proof_keys.clone()).unwrap());
+                }
             });
-        },
-        &[5_000, 10_000],
-    );
+        }
 
-    c.bench_function("SMT generate merkle proof", |b| {
-        let mut rng = thread_rng();
-        let (smt, mut keys) = random_smt(10_000, &mut rng);
-        keys.dedup();
-        let keys: Vec<_> = keys.into_iter().take(TARGET_LEAVES_COUNT).collect();
-        b.iter(|| {
-            smt.merkle_proof(keys.clone()).unwrap();
+        // updates overwrite existing keys, so the size of the tree is stable
+        let id = format!("{}/update/{}", S::NAME, size);
+        report_reads(&id, &smt, |smt| {
+            let (key, value) = random_updates(&keys, 1, &mut thread_rng())[0];
+            smt.update(key, value).unwrap();
+        });
+        c.bench_function(&id, {
+            let (smt, keys) = (Rc::clone(&smt), Rc::clone(&keys));
+            move |b| {
+                let mut smt = smt.borrow_mut();
+                let mut rng = thread_rng();
+                b.iter(|| {
+                    let (key, value) = (keys[rng.gen_range(0, keys.len())], random_h256(&mut rng));
+                    smt.update(key, value).unwrap();
+                });
+            }
         });
-    });
 
-    c.bench_function("SMT verify merkle proof", |b| {
-        let mut rng = thread_rng();
-        let (smt, mut keys) = random_smt(10_000, &mut rng);
-        keys.dedup();
+        // the same kind of batch by update_all and update
+        let id = format!("{}/update_all {} leaves/{}", S::NAME, BATCH_SIZE, size);
+        report_reads(&id, &smt, |smt| {
+            smt.update_all(random_updates(&keys, BATCH_SIZE, &mut thread_rng()))
+                .unwrap();
+        });
+        c.bench_function(&id, {
+            let (smt, keys) = (Rc::clone(&smt), Rc::clone(&keys));
+            move |b| {
+                let mut smt = smt.borrow_mut();
+                let mut rng = thread_rng();
+                b.iter_with_setup(
+                    || random_updates(&keys, BATCH_SIZE, &mut rng),
+                    |leaves| {
+                        smt.update_all(leaves).unwrap();
+                    },
+                );
+            }
+        });
+        let id = format!(
+            "{}/update {} leaves one by one/{}",
+            S::NAME,
+            BATCH_SIZE,
+            size
+        );
+        c.bench_function(&id, {
+            let (smt, keys) = (Rc::clone(&smt), Rc::clone(&keys));
+            move |b| {
+                let mut smt = smt.borrow_mut();
+                let mut rng = thread_rng();
+                b.iter_with_setup(
+                    || random_updates(&keys, BATCH_SIZE, &mut rng),
+                    |leaves| {
+                        for (key, value) in leaves {
+                            smt.update(key, value).unwrap();
+                        }
+                    },
+                );
+            }
+        });
+
+        // delete an existing key, the key is inserted back in setup
+        let id = format!("{}/delete/{}", S::NAME, size);
+        c.bench_function(&id, {
+            let (smt, keys) = (Rc::clone(&smt), Rc::clone(&keys));
+            move |b| {
+                let mut rng = thread_rng();
+                b.iter_with_setup(
+                    || {
+                        let key = keys[rng.gen_range(0, keys.len())];
+                        smt.borrow_mut().update(key, random_h256(&mut rng)).unwrap();
+                        key
+                    },
+                    |key| {
+                        smt.borrow_mut().update(key, H256::zero()).unwrap();
+                    },
+                );
+            }
+        });
+    }
+}
+
+fn bench_verify(c: &mut Criterion) {
+    let mut rng = thread_rng();
+    let (smt, keys) = random_smt::<DefaultStore<H256>>(10_000, &mut rng);
+    for &keys_count in PROOF_KEYS_COUNTS.iter() {
         let leaves: Vec<_> = keys
             .iter()
-            .take(TARGET_LEAVES_COUNT)
+            .take(keys_count)
             .map(|k| (*k, smt.get(k).unwrap()))
             .collect();
         let proof = smt
-            .merkle_proof(keys.into_iter().take(TARGET_LEAVES_COUNT).collect())
+            .merkle_proof(leaves.iter().map(|(k, _v)| *k).collect())
             .unwrap();
-        let root = smt.root();
-        b.iter(|| {
-            let valid = proof.clone().verify::<Blake2bHasher>(root, leaves.clone());
-            assert!(valid.expect("verify result"));
+        let compiled_proof = proof.clone().compile(leaves.clone()).unwrap();
+        let root = *smt.root();
+
+        c.bench_function(&format!("verify merkle proof {} keys", keys_count), {
+            let (proof, leaves) = (proof.clone(), leaves.clone());
+            move |b| {
+                b.iter(|| {
+                    let valid = proof.clone().verify::<Blake2bHasher>(&root, leaves.clone());
+                    assert!(valid.expect("verify result"));
+                });
+            }
+        });
+        c.bench_function(&format!("compile merkle proof {} keys", keys_count), {
+            let leaves = leaves.clone();
+            move |b| {
+                b.iter(|| proof.clone().compile(leaves.clone()).unwrap());
+            }
+        });
+        c.bench_function(&format!("verify compiled proof {} keys", keys_count), {
+            move |b| {
+                b.iter(|| {
+                    let valid = compiled_proof.verify::<Blake2bHasher>(&root, leaves.clone());
+                    assert!(valid.expect("verify result"));
+                });
+            }
         });
-    });
+    }
+}
+
+fn bench(c: &mut Criterion) {
+    bench_store::<DefaultStore<H256>>(c);
+    bench_store::<ArenaStore<H256>>(c);
+    bench_store::<IoStore>(c);
+    bench_verify(c);
 }
 
 criterion_group!(
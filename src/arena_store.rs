@@ -0,0 +1,369 @@
+use crate::{
+    borrow::Cow,
+    error::Error,
+    string,
+    traits::Store,
+    tree::{BranchNode, LeafNode, NodeType},
+    vec::Vec,
+    H256,
+};
+
+// the leaf record holds a leaf
+const HAS_LEAF: u8 = 1;
+// the leaf record holds the single branch of the leaf
+const HAS_BRANCH: u8 = 2;
+
+// tag of leaf record ids in the index
+const LEAF_TAG: u32 = 1 << 31;
+const MAX_ID: u32 = LEAF_TAG - 3;
+const EMPTY: u64 = 0;
+const TOMBSTONE: u64 = u32::MAX as u64;
+
+/// 32 bits of the hash to place a node in the index
+fn fragment(node: &H256) -> u32 {
+    let mut data = [0u8; 4];
+    data.copy_from_slice(&node.as_slice()[..4]);
+    u32::from_le_bytes(data)
+}
+
+/// Open addressing index from node hash to record id,
+/// ids of leaf records are tagged by `LEAF_TAG`
+///
+/// A slot packs 32 bits of the hash and the record id in a `u64`, so the index
+/// is small enough to stay in cache, and the records are only read for
+/// hashes with the same fragment. Nodes are keyed by hashes of the hasher of
+/// the tree, which are already uniformly distributed.
+#[derive(Debug, Clone, Default)]
+struct Index {
+    // fragment << 32 | (id + 1), zero is empty
+    slots: Vec<u64>,
+    len: usize,
+    tombstones: usize,
+}
+
+impl Index {
+    fn find<F: Fn(u32) -> bool>(&self, fragment: u32, is_match: F) -> Option<(usize, u32)> {
+        if self.slots.is_empty() {
+            return None;
+        }
+        let mask = self.slots.len() - 1;
+        let mut pos = fragment as usize & mask;
+        loop {
+            let slot = self.slots[pos];
+            if slot == EMPTY {
+                return None;
+            }
+            if slot != TOMBSTONE && (slot >> 32) as u32 == fragment {
+                let id = slot as u32 - 1;
+                if is_match(id) {
+                    return Some((pos, id));
+                }
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    /// Insert a node which is not in the index
+    fn insert(&mut self, fragment: u32, id: u32) {
+        // keep load factor under 3/4
+        if (self.len + self.tombstones + 1) * 4 > self.slots.len() * 3 {
+            self.resize();
+        }
+        let mask = self.slots.len() - 1;
+        let mut pos = fragment as usize & mask;
+        while self.slots[pos] != EMPTY && self.slots[pos] != TOMBSTONE {
+            pos = (pos + 1) & mask;
+        }
+        if self.slots[pos] == TOMBSTONE {
+            self.tombstones -= 1;
+        }
+        self.slots[pos] = (fragment as u64) << 32 | (id as u64 + 1);
+        self.len += 1;
+    }
+
+    fn remove(&mut self, pos: usize) {
+        self.slots[pos] = TOMBSTONE;
+        self.len -= 1;
+        self.tombstones += 1;
+    }
+
+    fn resize(&mut self) {
+        let capacity = core::cmp::max(16, (self.len + 1).next_power_of_two() * 2);
+        let mut new_slots = Vec::new();
+        new_slots.resize(capacity, EMPTY);
+        let slots = core::mem::replace(&mut self.slots, new_slots);
+        let mask = capacity - 1;
+        for slot in slots {
+            if slot != EMPTY && slot != TOMBSTONE {
+                let mut pos = (slot >> 32) as usize & mask;
+                while self.slots[pos] != EMPTY {
+                    pos = (pos + 1) & mask;
+                }
+                self.slots[pos] = slot;
+            }
+        }
+        self.tombstones = 0;
+    }
+}
+
+#[derive(Debug, Clone)]
+struct BranchRecord {
+    node: H256,
+    branch: BranchNode,
+}
+
+#[derive(Debug, Clone)]
+struct LeafRecord<V> {
+    node: H256,
+    flags: u8,
+    leaf: LeafNode<V>,
+}
+
+/// An in-memory store keeping nodes in arenas
+///
+/// Branches and leaves are stored in two arenas of records and addressed
+/// by `u32` ids in one compact index, ids of removed records are reused.
+/// The single branch of a leaf is derived from the leaf record instead of
+/// stored as a branch record, so a leaf costs one leaf record.
+#[derive(Debug, Clone)]
+pub struct ArenaStore<V> {
+    index: Index,
+    branches: Vec<BranchRecord>,
+    free_branches: Vec<u32>,
+    leaves: Vec<LeafRecord<V>>,
+    free_leaves: Vec<u32>,
+    branches_count: usize,
+    leaves_count: usize,
+}
+
+impl<V> Default for ArenaStore<V> {
+    fn default() -> Self {
+        ArenaStore {
+            index: Default::default(),
+            branches: Vec::new(),
+            free_branches: Vec::new(),
+            leaves: Vec::new(),
+            free_leaves: Vec::new(),
+            branches_count: 0,
+            leaves_count: 0,
+        }
+    }
+}
+
+impl<V> ArenaStore<V> {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Number of stored branches
+    pub fn branches_count(&self) -> usize {
+        self.branches_count
+    }
+
+    /// Number of stored leaves
+    pub fn leaves_count(&self) -> usize {
+        self.leaves_count
+    }
+
+    pub fn clear(&mut self) {
+        *self = Self::default();
+    }
+
+    fn is_branch_record(&self, id: u32, node: &H256) -> bool {
+        id & LEAF_TAG == 0 && &self.branches[id as usize].node == node
+    }
+
+    fn is_leaf_record(&self, id: u32, node: &H256) -> bool {
+        id & LEAF_TAG != 0 && &self.leaves[(id & !LEAF_TAG) as usize].node == node
+    }
+
+    fn find_branch(&self, node: &H256) -> Option<(usize, u32)> {
+        self.index
+            .find(fragment(node), |id| self.is_branch_record(id, node))
+    }
+
+    /// Return the leaf record at node and its flags
+    fn find_leaf(&self, node: &H256) -> Option<(usize, u32, u8)> {
+        self.index
+            .find(fragment(node), |id| self.is_leaf_record(id, node))
+            .map(|(pos, id)| {
+                let id = id & !LEAF_TAG;
+                (pos, id, self.leaves[id as usize].flags)
+            })
+    }
+
+    fn derived_branch(&self, node: &H256, id: u32) -> BranchNode {
+        BranchNode {
+            fork_height: 0,
+            key: self.leaves[id as usize].leaf.key,
+            node_type: NodeType::Single(*node),
+        }
+    }
+
+    fn insert_branch_record(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        if let Some((_pos, id)) = self.find_branch(&node) {
+            self.branches[id as usize].branch = branch;
+            return Ok(());
+        }
+        let record = BranchRecord { node, branch };
+        let id = match self.free_branches.pop() {
+            Some(id) => {
+                self.branches[id as usize] = record;
+                id
+            }
+            None => {
+                let id = self.branches.len();
+                if id > MAX_ID as usize {
+                    return Err(arena_full());
+                }
+                self.branches.push(record);
+                id as u32
+            }
+        };
+        self.index.insert(fragment(&node), id);
+        self.branches_count += 1;
+        Ok(())
+    }
+
+    fn insert_leaf_record(&mut self, record: LeafRecord<V>) -> Result<(), Error> {
+        let node = record.node;
+        let id = match self.free_leaves.pop() {
+            Some(id) => {
+                self.leaves[id as usize] = record;
+                id
+            }
+            None => {
+                let id = self.leaves.len();
+                if id > MAX_ID as usize {
+                    return Err(arena_full());
+                }
+                self.leaves.push(record);
+                id as u32
+            }
+        };
+        self.index.insert(fragment(&node), id | LEAF_TAG);
+        Ok(())
+    }
+
+    /// Set flags of a leaf record, the record is freed if flags are empty
+    fn set_leaf_flags(&mut self, pos: usize, id: u32, flags: u8) {
+        self.leaves[id as usize].flags = flags;
+        if flags == 0 {
+            self.index.remove(pos);
+            self.free_leaves.push(id);
+        }
+    }
+}
+
+fn arena_full() -> Error {
+    Error::Store(string::String::from("arena store is full"))
+}
+
+impl<V: Clone> Store<V> for ArenaStore<V> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.get_branch_ref(node)
+            .map(|branch| branch.map(Cow::into_owned))
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        self.get_leaf_ref(leaf_hash)
+            .map(|leaf| leaf.map(Cow::into_owned))
+    }
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        // a node has either a branch record or a leaf record holding the branch
+        let found = self.index.find(fragment(node), |id| {
+            self.is_branch_record(id, node)
+                || (self.is_leaf_record(id, node)
+                    && self.leaves[(id & !LEAF_TAG) as usize].flags & HAS_BRANCH != 0)
+        });
+        Ok(found.map(|(_pos, id)| {
+            if id & LEAF_TAG != 0 {
+                Cow::Owned(self.derived_branch(node, id & !LEAF_TAG))
+            } else {
+                Cow::Borrowed(&self.branches[id as usize].branch)
+            }
+        }))
+    }
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error> {
+        match self.find_leaf(leaf_hash) {
+            Some((_pos, id, flags)) if flags & HAS_LEAF != 0 => {
+                Ok(Some(Cow::Borrowed(&self.leaves[id as usize].leaf)))
+            }
+            _ => Ok(None),
+        }
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        match self.find_leaf(&node) {
+            Some((_pos, id, flags)) if branch == self.derived_branch(&node, id) => {
+                if flags & HAS_BRANCH == 0 {
+                    self.leaves[id as usize].flags = flags | HAS_BRANCH;
+                    self.branches_count += 1;
+                }
+                // the branch is derived from the leaf from now on
+                if let Some((pos, id)) = self.find_branch(&node) {
+                    self.index.remove(pos);
+                    self.free_branches.push(id);
+                    self.branches_count -= 1;
+                }
+            }
+            Some((pos, id, flags)) if flags & HAS_BRANCH != 0 => {
+                self.set_leaf_flags(pos, id, flags & !HAS_BRANCH);
+                self.branches_count -= 1;
+                self.insert_branch_record(node, branch)?;
+            }
+            _ => self.insert_branch_record(node, branch)?,
+        }
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        match self.find_leaf(&leaf_hash) {
+            Some((_pos, id, mut flags)) => {
+                if flags & HAS_BRANCH != 0 && self.leaves[id as usize].leaf.key != leaf.key {
+                    // keep the branch derived from the replaced leaf
+                    let branch = self.derived_branch(&leaf_hash, id);
+                    self.insert_branch_record(leaf_hash, branch)?;
+                    // the branch is moved, the count is unchanged
+                    self.branches_count -= 1;
+                    flags &= !HAS_BRANCH;
+                }
+                if flags & HAS_LEAF == 0 {
+                    self.leaves_count += 1;
+                }
+                let record = &mut self.leaves[id as usize];
+                record.flags = flags | HAS_LEAF;
+                record.leaf = leaf;
+            }
+            None => {
+                self.insert_leaf_record(LeafRecord {
+                    node: leaf_hash,
+                    flags: HAS_LEAF,
+                    leaf,
+                })?;
+                self.leaves_count += 1;
+            }
+        }
+        Ok(())
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        if let Some((pos, id)) = self.find_branch(node) {
+            self.index.remove(pos);
+            self.free_branches.push(id);
+            self.branches_count -= 1;
+        } else if let Some((pos, id, flags)) = self.find_leaf(node) {
+            if flags & HAS_BRANCH != 0 {
+                self.set_leaf_flags(pos, id, flags & !HAS_BRANCH);
+                self.branches_count -= 1;
+            }
+        }
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        if let Some((pos, id, flags)) = self.find_leaf(leaf_hash) {
+            if flags & HAS_LEAF != 0 {
+                // the record is kept if it holds the branch
+                self.set_leaf_flags(pos, id, flags & !HAS_LEAF);
+                self.leaves_count -= 1;
+            }
+        }
+        Ok(())
+    }
+}
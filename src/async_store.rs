@@ -0,0 +1,131 @@
+//! Async backend storage
+//!
+//! `AsyncStore` is the async version of `Store` for stores behind a network,
+//! the tree reads it by `SparseMerkleTree::async_get`, `async_merkle_proof`,
+//! `async_compiled_merkle_proof` and `async_update_all`. Like the sync methods,
+//! proofs and batch updates read one level of the tree per `get_branches` call,
+//! the default `get_branches` polls `get_branch` of all nodes concurrently,
+//! so a proof takes about one round trip per level of the tree.
+//!
+//! The futures of the store are `Send`, so the futures of the tree methods
+//! can be spawned on multi-threaded executors when the hasher and the value
+//! are `Sync`.
+//!
+//! Requires the `async` feature, which needs Rust 1.75 or later.
+
+use crate::{
+    boxed::Box,
+    error::Error,
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+use core::{
+    future::Future,
+    pin::Pin,
+    task::{Context, Poll},
+};
+
+/// Trait for customize async backend storage, see `Store`
+pub trait AsyncStore<V: Send>: Send + Sync {
+    fn get_branch(
+        &self,
+        node: &H256,
+    ) -> impl Future<Output = Result<Option<BranchNode>, Error>> + Send;
+    fn get_leaf(
+        &self,
+        leaf_hash: &H256,
+    ) -> impl Future<Output = Result<Option<LeafNode<V>>, Error>> + Send;
+    /// Get multiple branches, the tree reads one level of nodes at a time.
+    /// The default implementation polls `get_branch` of all nodes concurrently,
+    /// backends supporting batched reads should override it.
+    fn get_branches(
+        &self,
+        nodes: &[H256],
+    ) -> impl Future<Output = Result<Vec<Option<BranchNode>>, Error>> + Send {
+        async move {
+            join_all(nodes.iter().map(|node| self.get_branch(node)))
+                .await
+                .into_iter()
+                .collect()
+        }
+    }
+    /// Get multiple leaves, see `get_branches`
+    fn get_leaves(
+        &self,
+        leaf_hashes: &[H256],
+    ) -> impl Future<Output = Result<Vec<Option<LeafNode<V>>>, Error>> + Send {
+        async move {
+            join_all(leaf_hashes.iter().map(|leaf_hash| self.get_leaf(leaf_hash)))
+                .await
+                .into_iter()
+                .collect()
+        }
+    }
+    fn insert_branch(
+        &mut self,
+        node: H256,
+        branch: BranchNode,
+    ) -> impl Future<Output = Result<(), Error>> + Send;
+    fn insert_leaf(
+        &mut self,
+        leaf_hash: H256,
+        leaf: LeafNode<V>,
+    ) -> impl Future<Output = Result<(), Error>> + Send;
+    fn remove_branch(&mut self, node: &H256) -> impl Future<Output = Result<(), Error>> + Send;
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> impl Future<Output = Result<(), Error>> + Send;
+}
+
+/// Poll futures concurrently, outputs are in the order of futures
+pub fn join_all<I: IntoIterator>(futures: I) -> JoinAll<I::Item>
+where
+    I::Item: Future,
+{
+    let futures: Vec<_> = futures
+        .into_iter()
+        .map(|future| Some(Box::pin(future)))
+        .collect();
+    let mut outputs = Vec::with_capacity(futures.len());
+    outputs.resize_with(futures.len(), || None);
+    JoinAll { futures, outputs }
+}
+
+/// Future of `join_all`
+pub struct JoinAll<F: Future> {
+    // pending futures, a future is dropped once it is ready
+    futures: Vec<Option<Pin<Box<F>>>>,
+    outputs: Vec<Option<F::Output>>,
+}
+
+// outputs are never pinned, futures are pinned in boxes
+impl<F: Future> Unpin for JoinAll<F> {}
+
+impl<F: Future> Future for JoinAll<F> {
+    type Output = Vec<F::Output>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let this = self.get_mut();
+        let mut pending = false;
+        for (future, output) in this.futures.iter_mut().zip(this.outputs.iter_mut()) {
+            if let Some(fut) = future {
+                match fut.as_mut().poll(cx) {
+                    Poll::Ready(value) => {
+                        *output = Some(value);
+                        *future = None;
+                    }
+                    Poll::Pending => pending = true,
+                }
+            }
+        }
+        if pending {
+            return Poll::Pending;
+        }
+        let outputs = core::mem::take(&mut this.outputs);
+        Poll::Ready(
+            outputs
+                .into_iter()
+                .map(|output| output.expect("ready output"))
+                .collect(),
+        )
+    }
+}
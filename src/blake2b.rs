@@ -5,15 +5,115 @@ const BLAKE2B_KEY: &[u8] = &[];
 const BLAKE2B_LEN: usize = 32;
 const PERSONALIZATION: &[u8] = b"sparsemerkletree";
 
+const IV: [u64; 8] = [
+    0x6a09_e667_f3bc_c908,
+    0xbb67_ae85_84ca_a73b,
+    0x3c6e_f372_fe94_f82b,
+    0xa54f_f53a_5f1d_36f1,
+    0x510e_527f_ade6_82d1,
+    0x9b05_688c_2b3e_6c1f,
+    0x1f83_d9ab_fb41_bd6b,
+    0x5be0_cd19_137e_2179,
+];
+
+const SIGMA: [[usize; 16]; 12] = [
+    [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15],
+    [14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3],
+    [11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4],
+    [7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8],
+    [9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13],
+    [2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9],
+    [12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11],
+    [13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10],
+    [6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5],
+    [10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0],
+    [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15],
+    [14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3],
+];
+
+const fn load_u64(bytes: &[u8], offset: usize) -> u64 {
+    let mut word = 0u64;
+    let mut i = 0;
+    while i < 8 {
+        word |= (bytes[offset + i] as u64) << (8 * i);
+        i += 1;
+    }
+    word
+}
+
+/// Initial state of the hasher, IV xor the parameter block:
+/// digest length, no key, fanout 1, depth 1 and the personalization
+const INIT_STATE: [u64; 8] = [
+    IV[0] ^ 0x0101_0000 ^ ((BLAKE2B_KEY.len() as u64) << 8) ^ BLAKE2B_LEN as u64,
+    IV[1],
+    IV[2],
+    IV[3],
+    IV[4],
+    IV[5],
+    IV[6] ^ load_u64(PERSONALIZATION, 0),
+    IV[7] ^ load_u64(PERSONALIZATION, 8),
+];
+
+#[inline(always)]
+fn g(v: &mut [u64; 16], a: usize, b: usize, c: usize, d: usize, x: u64, y: u64) {
+    v[a] = v[a].wrapping_add(v[b]).wrapping_add(x);
+    v[d] = (v[d] ^ v[a]).rotate_right(32);
+    v[c] = v[c].wrapping_add(v[d]);
+    v[b] = (v[b] ^ v[c]).rotate_right(24);
+    v[a] = v[a].wrapping_add(v[b]).wrapping_add(y);
+    v[d] = (v[d] ^ v[a]).rotate_right(16);
+    v[c] = v[c].wrapping_add(v[d]);
+    v[b] = (v[b] ^ v[c]).rotate_right(63);
+}
+
+/// Hash 64 bytes, the input is the only and the last block,
+/// so the whole hash is one compression from the precomputed state
+#[inline]
+fn hash_block(lhs: &H256, rhs: &H256) -> H256 {
+    let mut m = [0u64; 16];
+    for (i, word) in m[..8].iter_mut().enumerate() {
+        let data = if i < 4 { lhs } else { rhs };
+        *word = load_u64(data.as_slice(), (i % 4) * 8);
+    }
+    let mut v = [0u64; 16];
+    v[..8].copy_from_slice(&INIT_STATE);
+    v[8..].copy_from_slice(&IV);
+    // the counter of 64 bytes and the final block flag
+    v[12] ^= 64;
+    v[14] = !v[14];
+    for s in SIGMA.iter() {
+        g(&mut v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(&mut v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(&mut v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(&mut v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(&mut v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(&mut v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(&mut v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(&mut v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    // the digest is the first 4 words of the state
+    let mut hash = [0u8; 32];
+    for (i, chunk) in hash.chunks_exact_mut(8).enumerate() {
+        let word = INIT_STATE[i] ^ v[i] ^ v[i + 8];
+        chunk.copy_from_slice(&word.to_le_bytes());
+    }
+    hash.into()
+}
+
 pub struct Blake2bHasher(Blake2b);
 
 impl Default for Blake2bHasher {
     fn default() -> Self {
-        let blake2b = Blake2bBuilder::new(BLAKE2B_LEN)
+        Blake2bHasher(Self::new_blake2b())
+    }
+}
+
+impl Blake2bHasher {
+    fn new_blake2b() -> Blake2b {
+        Blake2bBuilder::new(BLAKE2B_LEN)
             .personal(PERSONALIZATION)
             .key(BLAKE2B_KEY)
-            .build();
-        Blake2bHasher(blake2b)
+            .build()
     }
 }
 
@@ -26,4 +126,7 @@ impl Hasher for Blake2bHasher {
         self.0.finalize(&mut hash);
         hash.into()
     }
+    fn hash_pair(lhs: &H256, rhs: &H256) -> H256 {
+        hash_block(lhs, rhs)
+    }
 }
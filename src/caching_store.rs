@@ -0,0 +1,264 @@
+use crate::{
+    default_store::Map,
+    error::Error,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+use core::cell::{Cell, RefCell};
+
+/// Approximate memory used by a cached branch
+pub const CACHED_BRANCH_SIZE: usize =
+    core::mem::size_of::<LruEntry>() + core::mem::size_of::<(H256, usize)>();
+
+const NIL: usize = usize::MAX;
+
+/// A read-through store which caches recently used branches of another store
+///
+/// Branches near the root are read by every traversal, a small cache keeps
+/// them in memory, the least recently used branch is evicted when the cache
+/// exceeds the byte budget. Writes go to the inner store and the cache.
+/// Leaves are not cached.
+///
+/// The cache is updated on reads through interior mutability,
+/// so the store is not `Sync`.
+#[derive(Debug)]
+pub struct CachingStore<S> {
+    inner: S,
+    cache: RefCell<LruCache>,
+    hits: Cell<u64>,
+    misses: Cell<u64>,
+}
+
+impl<S> CachingStore<S> {
+    /// Cache branches of inner store in about byte_budget bytes
+    pub fn new(inner: S, byte_budget: usize) -> Self {
+        CachingStore {
+            inner,
+            cache: RefCell::new(LruCache::new(byte_budget / CACHED_BRANCH_SIZE)),
+            hits: Cell::new(0),
+            misses: Cell::new(0),
+        }
+    }
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+    /// Destroy the cache and retake the inner store
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+    /// Number of branch reads served by the cache
+    pub fn hits(&self) -> u64 {
+        self.hits.get()
+    }
+    /// Number of branch reads passed to the inner store
+    pub fn misses(&self) -> u64 {
+        self.misses.get()
+    }
+    pub fn reset_counters(&self) {
+        self.hits.set(0);
+        self.misses.set(0);
+    }
+    /// Number of cached branches
+    pub fn cached_branches(&self) -> usize {
+        self.cache.borrow().map.len()
+    }
+    /// Max number of cached branches
+    pub fn capacity(&self) -> usize {
+        self.cache.borrow().capacity
+    }
+    /// Drop all cached branches
+    pub fn clear_cache(&mut self) {
+        self.cache.get_mut().clear();
+    }
+}
+
+impl<S: Store<V>, V> Store<V> for CachingStore<S> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        if let Some(branch) = self.cache.borrow_mut().get(node) {
+            self.hits.set(self.hits.get() + 1);
+            return Ok(Some(branch.clone()));
+        }
+        self.misses.set(self.misses.get() + 1);
+        let branch = self.inner.get_branch(node)?;
+        if let Some(branch) = branch.as_ref() {
+            self.cache.borrow_mut().insert(*node, branch.clone());
+        }
+        Ok(branch)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        let mut branches = Vec::with_capacity(nodes.len());
+        let mut missing_nodes = Vec::new();
+        {
+            let mut cache = self.cache.borrow_mut();
+            for node in nodes {
+                let branch = cache.get(node).cloned();
+                if branch.is_none() {
+                    missing_nodes.push(*node);
+                }
+                branches.push(branch);
+            }
+        }
+        self.hits
+            .set(self.hits.get() + (nodes.len() - missing_nodes.len()) as u64);
+        if missing_nodes.is_empty() {
+            return Ok(branches);
+        }
+        self.misses
+            .set(self.misses.get() + missing_nodes.len() as u64);
+        let mut fetched = self.inner.get_branches(&missing_nodes)?.into_iter();
+        let mut cache = self.cache.borrow_mut();
+        for (node, branch) in nodes.iter().zip(branches.iter_mut()) {
+            if branch.is_none() {
+                *branch = fetched.next().flatten();
+                if let Some(branch) = branch.as_ref() {
+                    cache.insert(*node, branch.clone());
+                }
+            }
+        }
+        Ok(branches)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<V>>>, Error> {
+        self.inner.get_leaves(leaf_hashes)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.inner.insert_branch(node, branch.clone())?;
+        self.cache.get_mut().insert(node, branch);
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        // remove from cache first, so the cache never has stale branches
+        self.cache.get_mut().remove(node);
+        self.inner.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+#[derive(Debug)]
+struct LruEntry {
+    node: H256,
+    branch: BranchNode,
+    prev: usize,
+    next: usize,
+}
+
+/// LRU cache of branches, entries are linked from the most to the least recently used
+#[derive(Debug)]
+struct LruCache {
+    capacity: usize,
+    // node -> index of entry
+    map: Map<H256, usize>,
+    entries: Vec<LruEntry>,
+    // indexes of removed entries
+    free: Vec<usize>,
+    head: usize,
+    tail: usize,
+}
+
+impl LruCache {
+    fn new(capacity: usize) -> Self {
+        LruCache {
+            capacity,
+            map: Default::default(),
+            entries: Vec::new(),
+            free: Vec::new(),
+            head: NIL,
+            tail: NIL,
+        }
+    }
+
+    fn clear(&mut self) {
+        self.map.clear();
+        self.entries.clear();
+        self.free.clear();
+        self.head = NIL;
+        self.tail = NIL;
+    }
+
+    fn unlink(&mut self, index: usize) {
+        let (prev, next) = (self.entries[index].prev, self.entries[index].next);
+        if prev == NIL {
+            self.head = next;
+        } else {
+            self.entries[prev].next = next;
+        }
+        if next == NIL {
+            self.tail = prev;
+        } else {
+            self.entries[next].prev = prev;
+        }
+    }
+
+    fn push_front(&mut self, index: usize) {
+        self.entries[index].prev = NIL;
+        self.entries[index].next = self.head;
+        if self.head == NIL {
+            self.tail = index;
+        } else {
+            self.entries[self.head].prev = index;
+        }
+        self.head = index;
+    }
+
+    fn get(&mut self, node: &H256) -> Option<&BranchNode> {
+        let index = *self.map.get(node)?;
+        if self.head != index {
+            self.unlink(index);
+            self.push_front(index);
+        }
+        Some(&self.entries[index].branch)
+    }
+
+    fn insert(&mut self, node: H256, branch: BranchNode) {
+        if self.capacity == 0 {
+            return;
+        }
+        if let Some(&index) = self.map.get(&node) {
+            self.entries[index].branch = branch;
+            self.unlink(index);
+            self.push_front(index);
+            return;
+        }
+        if self.map.len() >= self.capacity {
+            // evict the least recently used entry
+            let tail = self.tail;
+            self.unlink(tail);
+            self.map.remove(&self.entries[tail].node);
+            self.free.push(tail);
+        }
+        let entry = LruEntry {
+            node,
+            branch,
+            prev: NIL,
+            next: NIL,
+        };
+        let index = match self.free.pop() {
+            Some(index) => {
+                self.entries[index] = entry;
+                index
+            }
+            None => {
+                self.entries.push(entry);
+                self.entries.len() - 1
+            }
+        };
+        self.map.insert(node, index);
+        self.push_front(index);
+    }
+
+    fn remove(&mut self, node: &H256) {
+        if let Some(index) = self.map.remove(node) {
+            self.unlink(index);
+            self.free.push(index);
+        }
+    }
+}
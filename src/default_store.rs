@@ -1,4 +1,5 @@
 use crate::{
+    borrow::Cow,
     collections,
     error::Error,
     traits::Store,
@@ -32,6 +33,12 @@ impl<V: Clone> Store<V> for DefaultStore<V> {
     fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
         Ok(self.leaves_map.get(leaf_hash).map(Clone::clone))
     }
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        Ok(self.branches_map.get(node).map(Cow::Borrowed))
+    }
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error> {
+        Ok(self.leaves_map.get(leaf_hash).map(Cow::Borrowed))
+    }
     fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
         self.branches_map.insert(node, branch);
         Ok(())
@@ -0,0 +1,91 @@
+use crate::{
+    default_store::Map,
+    error::Result,
+    traits::{Hasher, Store, Value},
+    vec::Vec,
+    SparseMerkleTree, H256,
+};
+
+/// A tree deferring the hashing of updates until commit
+///
+/// `update` only records the new value of a key, overwriting a key in the
+/// same batch replaces the recorded value. `commit` applies recorded updates
+/// by `SparseMerkleTree::update_all`, every dirty node is hashed and written
+/// once from bottom to top.
+#[derive(Debug, Default)]
+pub struct DeferredTree<H, V, S> {
+    tree: SparseMerkleTree<H, V, S>,
+    pending: Map<H256, V>,
+}
+
+impl<H: Hasher + Default, V: Value, S: Store<V>> DeferredTree<H, V, S> {
+    pub fn new(tree: SparseMerkleTree<H, V, S>) -> Self {
+        DeferredTree {
+            tree,
+            pending: Default::default(),
+        }
+    }
+
+    /// The committed tree
+    pub fn tree(&self) -> &SparseMerkleTree<H, V, S> {
+        &self.tree
+    }
+
+    /// Destroy the deferred tree and retake the committed tree, pending updates are dropped
+    pub fn into_tree(self) -> SparseMerkleTree<H, V, S> {
+        self.tree
+    }
+
+    /// Root of the committed tree, pending updates are not included
+    pub fn committed_root(&self) -> &H256 {
+        self.tree.root()
+    }
+
+    /// Number of keys updated since the last commit
+    pub fn pending_count(&self) -> usize {
+        self.pending.len()
+    }
+
+    /// Record an update, set to zero value to delete a key
+    pub fn update(&mut self, key: H256, value: V) {
+        self.pending.insert(key, value);
+    }
+
+    /// Get value of a leaf, pending updates are included
+    pub fn get(&self, key: &H256) -> Result<V>
+    where
+        V: Clone,
+    {
+        match self.pending.get(key) {
+            Some(value) => Ok(value.clone()),
+            None => self.tree.get(key),
+        }
+    }
+
+    /// Apply pending updates, return new merkle root
+    ///
+    /// Pending updates are kept if an error is returned and the committed root
+    /// is not changed, so the commit can be retried. The store may be partly
+    /// written in this case, see `SparseMerkleTree::update_all`.
+    pub fn commit(&mut self) -> Result<&H256>
+    where
+        V: Clone,
+    {
+        if self.pending.is_empty() {
+            return Ok(self.tree.root());
+        }
+        let leaves: Vec<(H256, V)> = self
+            .pending
+            .iter()
+            .map(|(key, value)| (*key, value.clone()))
+            .collect();
+        self.tree.update_all(leaves)?;
+        self.pending.clear();
+        Ok(self.tree.root())
+    }
+
+    /// Drop pending updates
+    pub fn discard(&mut self) {
+        self.pending.clear();
+    }
+}
@@ -16,6 +16,9 @@ pub enum Error {
     NonSiblings,
     InvalidCode(u8),
     NonMergableRange,
+    CorruptedNode,
+    CorruptedSnapshot,
+    UnsortedKeys(H256),
 }
 
 impl core::fmt::Display for Error {
@@ -61,6 +64,15 @@ impl core::fmt::Display for Error {
             Error::NonMergableRange => {
                 write!(f, "Ranges can not be merged")?;
             }
+            Error::CorruptedNode => {
+                write!(f, "Corrupted packed node")?;
+            }
+            Error::CorruptedSnapshot => {
+                write!(f, "Corrupted snapshot")?;
+            }
+            Error::UnsortedKeys(key) => {
+                write!(f, "Keys are unsorted or duplicated at {:?}", key)?;
+            }
         }
         Ok(())
     }
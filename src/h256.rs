@@ -42,12 +42,21 @@ impl H256 {
         &self.0[..]
     }
 
+    /// Read the i-th 64 bits word, word 3 holds the heighest bits
+    #[inline]
+    fn word(&self, i: usize) -> u64 {
+        let mut data = [0u8; 8];
+        data.copy_from_slice(&self.0[i * 8..(i + 1) * 8]);
+        u64::from_le_bytes(data)
+    }
+
     /// Treat H256 as a path in a tree
     /// fork height is the number of common bits(from heigher to lower: 255..=0) of two H256
     pub fn fork_height(&self, key: &H256) -> u8 {
-        for h in (0..=core::u8::MAX).rev() {
-            if self.get_bit(h) != key.get_bit(h) {
-                return h;
+        for i in (0..4).rev() {
+            let diff = self.word(i) ^ key.word(i);
+            if diff != 0 {
+                return (i * 64 + 63 - diff.leading_zeros() as usize) as u8;
             }
         }
         0
@@ -66,17 +75,12 @@ impl H256 {
     /// Copy bits and return a new H256
     pub fn copy_bits(&self, start: u8) -> Self {
         let mut target = H256::zero();
-
-        let start_byte = (start / BYTE_SIZE) as usize;
-        // copy bytes
-        target.0[start_byte..].copy_from_slice(&self.0[start_byte..]);
-
-        // reset remain bytes
-        let remain = start % BYTE_SIZE;
-        if remain > 0 {
-            target.0[start_byte] &= 0b11111111 << remain
-        }
-
+        let start = start as usize;
+        let start_word = start / 64;
+        // copy whole words, then reset lower bits of the first word
+        target.0[start_word * 8..].copy_from_slice(&self.0[start_word * 8..]);
+        let word = self.word(start_word) & (core::u64::MAX << (start % 64));
+        target.0[start_word * 8..(start_word + 1) * 8].copy_from_slice(&word.to_le_bytes());
         target
     }
 }
@@ -90,7 +94,13 @@ impl PartialOrd for H256 {
 impl Ord for H256 {
     fn cmp(&self, other: &Self) -> Ordering {
         // Compare bits from heigher to lower (255..0)
-        self.0.iter().rev().cmp(other.0.iter().rev())
+        for i in (0..4).rev() {
+            match self.word(i).cmp(&other.word(i)) {
+                Ordering::Equal => continue,
+                ordering => return ordering,
+            }
+        }
+        Ordering::Equal
     }
 }
 
@@ -0,0 +1,322 @@
+use crate::{
+    error::{Error, Result},
+    traits::Store,
+    tree::{BranchNode, LeafNode, NodeType},
+    vec::Vec,
+    H256,
+};
+use core::{
+    cmp::{max, Ordering},
+    marker::PhantomData,
+    ops::{Bound, RangeBounds},
+};
+
+/// Return the smallest and the largest key of a subtree,
+/// bits of key below height are free in the subtree
+fn subtree_range(key: &H256, height: u16) -> (H256, H256) {
+    let mut min: [u8; 32] = (*key).into();
+    let mut max = min;
+    for i in 0..32 {
+        let free_bits = core::cmp::min(height.saturating_sub(i as u16 * 8), 8);
+        let mask = ((1u16 << free_bits) - 1) as u8;
+        min[i] &= !mask;
+        max[i] |= mask;
+    }
+    (min.into(), max.into())
+}
+
+/// An iterator of leaves in a range of keys, in ascending order of keys
+///
+/// The tree is walked depth first from left to right, subtrees out of the
+/// range are skipped before their branches are read, so only the leaves in
+/// the range and their paths are read. Both children of a branch are read
+/// in one `get_branches` call. Memory is bounded by the height of the tree.
+///
+/// Iteration stops after an error is returned.
+#[derive(Debug)]
+pub struct LeafIter<'a, V, S> {
+    store: &'a S,
+    // the root is read on the first call of next
+    root: Option<H256>,
+    start: Bound<H256>,
+    end: Bound<H256>,
+    // branches to visit, the next one on the top
+    stack: Vec<BranchNode>,
+    phantom: PhantomData<V>,
+}
+
+impl<'a, V, S: Store<V>> LeafIter<'a, V, S> {
+    pub(crate) fn new(store: &'a S, root: H256, start: Bound<H256>, end: Bound<H256>) -> Self {
+        LeafIter {
+            store,
+            root: Some(root).filter(|root| !root.is_zero()),
+            start,
+            end,
+            stack: Vec::new(),
+            phantom: PhantomData,
+        }
+    }
+
+    fn before_start(&self, key: &H256) -> bool {
+        match &self.start {
+            Bound::Included(start) => key < start,
+            Bound::Excluded(start) => key <= start,
+            Bound::Unbounded => false,
+        }
+    }
+
+    fn after_end(&self, key: &H256) -> bool {
+        match &self.end {
+            Bound::Included(end) => key > end,
+            Bound::Excluded(end) => key >= end,
+            Bound::Unbounded => false,
+        }
+    }
+
+    /// Check some keys of the subtree are in the range
+    fn overlaps(&self, key: &H256, height: u16) -> bool {
+        let (min, max) = subtree_range(key, height);
+        !self.before_start(&max) && !self.after_end(&min)
+    }
+
+    fn next_leaf(&mut self) -> Result<Option<LeafNode<V>>> {
+        if let Some(root) = self.root.take() {
+            let branch = self
+                .store
+                .get_branch(&root)?
+                .ok_or(Error::MissingBranch(root))?;
+            self.stack.push(branch);
+        }
+        while let Some(branch) = self.stack.pop() {
+            let height = branch.fork_height;
+            match branch.node_at(height) {
+                NodeType::Single(leaf_hash) => {
+                    if self.before_start(&branch.key) || self.after_end(&branch.key) {
+                        continue;
+                    }
+                    let leaf = self
+                        .store
+                        .get_leaf(&leaf_hash)?
+                        .ok_or(Error::MissingLeaf(leaf_hash))?;
+                    return Ok(Some(leaf));
+                }
+                NodeType::Pair(left, right) => {
+                    let mut left_key = branch.key;
+                    left_key.clear_bit(height);
+                    let mut right_key = branch.key;
+                    right_key.set_bit(height);
+                    // push right child first, so the left child is visited first
+                    let mut nodes = Vec::with_capacity(2);
+                    if !right.is_zero() && self.overlaps(&right_key, height.into()) {
+                        nodes.push(right);
+                    }
+                    if !left.is_zero() && self.overlaps(&left_key, height.into()) {
+                        nodes.push(left);
+                    }
+                    if nodes.is_empty() {
+                        continue;
+                    }
+                    let branches = self.store.get_branches(&nodes)?;
+                    for (node, branch) in nodes.into_iter().zip(branches) {
+                        self.stack.push(branch.ok_or(Error::MissingBranch(node))?);
+                    }
+                }
+            }
+        }
+        Ok(None)
+    }
+}
+
+impl<'a, V, S: Store<V>> Iterator for LeafIter<'a, V, S> {
+    type Item = Result<LeafNode<V>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match self.next_leaf() {
+            Ok(leaf) => leaf.map(Ok),
+            Err(err) => {
+                self.root = None;
+                self.stack.clear();
+                Some(Err(err))
+            }
+        }
+    }
+}
+
+/// Number of the lowest free bits of keys in the subtree of branch,
+/// a leaf has no free bits
+fn free_bits(branch: &BranchNode) -> u16 {
+    match branch.node_type {
+        NodeType::Single(_) => 0,
+        NodeType::Pair(..) => u16::from(branch.fork_height) + 1,
+    }
+}
+
+/// Check keys of two subtrees share the bits above the lowest free bits
+fn same_prefix(lhs: &H256, rhs: &H256, free_bits: u16) -> bool {
+    free_bits > 255 || lhs.copy_bits(free_bits as u8) == rhs.copy_bits(free_bits as u8)
+}
+
+/// An iterator of keys changed between two roots, in ascending order of keys
+///
+/// Yields the new value of an inserted or updated key, and `None` for a deleted key.
+/// The two trees are walked together from the roots, subtrees with the same hash
+/// are skipped, so only the paths of changed keys are read.
+/// Both roots must be readable from the store, see `PersistentStore`.
+///
+/// Iteration stops after an error is returned.
+#[derive(Debug)]
+pub struct DiffIter<'a, V, S> {
+    store: &'a S,
+    // (old node, new node) of subtrees to compare, the next one on the top,
+    // a zero node is an empty subtree
+    stack: Vec<(H256, H256)>,
+    phantom: PhantomData<V>,
+}
+
+impl<'a, V, S: Store<V>> DiffIter<'a, V, S> {
+    pub(crate) fn new(store: &'a S, old_root: H256, new_root: H256) -> Self {
+        DiffIter {
+            store,
+            stack: [(old_root, new_root)].to_vec(),
+            phantom: PhantomData,
+        }
+    }
+
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>> {
+        if node.is_zero() {
+            return Ok(None);
+        }
+        self.store
+            .get_branch(node)?
+            .map(Some)
+            .ok_or(Error::MissingBranch(*node))
+    }
+
+    fn get_value(&self, leaf_hash: &H256) -> Result<V> {
+        self.store
+            .get_leaf(leaf_hash)?
+            .map(|leaf| leaf.value)
+            .ok_or(Error::MissingLeaf(*leaf_hash))
+    }
+
+    /// Push children of a pair, the left child is visited first
+    fn push_children(&mut self, old: (H256, H256), new: (H256, H256)) {
+        self.stack.push((old.1, new.1));
+        self.stack.push((old.0, new.0));
+    }
+
+    fn next_change(&mut self) -> Result<Option<(H256, Option<V>)>> {
+        while let Some((old, new)) = self.stack.pop() {
+            if old == new {
+                continue;
+            }
+            let (old_branch, new_branch) = match (self.get_branch(&old)?, self.get_branch(&new)?) {
+                (Some(old_branch), None) => match old_branch.node_at(old_branch.fork_height) {
+                    NodeType::Single(_) => return Ok(Some((old_branch.key, None))),
+                    NodeType::Pair(left, right) => {
+                        self.push_children((left, right), (H256::zero(), H256::zero()));
+                        continue;
+                    }
+                },
+                (None, Some(new_branch)) => match new_branch.node_at(new_branch.fork_height) {
+                    NodeType::Single(leaf_hash) => {
+                        let value = self.get_value(&leaf_hash)?;
+                        return Ok(Some((new_branch.key, Some(value))));
+                    }
+                    NodeType::Pair(left, right) => {
+                        self.push_children((H256::zero(), H256::zero()), (left, right));
+                        continue;
+                    }
+                },
+                (Some(old_branch), Some(new_branch)) => (old_branch, new_branch),
+                (None, None) => continue,
+            };
+            let (old_bits, new_bits) = (free_bits(&old_branch), free_bits(&new_branch));
+            if !same_prefix(&old_branch.key, &new_branch.key, max(old_bits, new_bits)) {
+                // disjoint subtrees, the old keys are deleted and the new keys are inserted
+                if old_branch.key < new_branch.key {
+                    self.stack.push((H256::zero(), new));
+                    self.stack.push((old, H256::zero()));
+                } else {
+                    self.stack.push((old, H256::zero()));
+                    self.stack.push((H256::zero(), new));
+                }
+                continue;
+            }
+            match old_bits.cmp(&new_bits) {
+                Ordering::Equal => match (
+                    old_branch.node_at(old_branch.fork_height),
+                    new_branch.node_at(new_branch.fork_height),
+                ) {
+                    (NodeType::Pair(old_left, old_right), NodeType::Pair(new_left, new_right)) => {
+                        self.push_children((old_left, old_right), (new_left, new_right));
+                    }
+                    (_, NodeType::Single(leaf_hash)) => {
+                        // the value of the key is updated
+                        let value = self.get_value(&leaf_hash)?;
+                        return Ok(Some((new_branch.key, Some(value))));
+                    }
+                    (NodeType::Single(_), NodeType::Pair(..)) => {
+                        unreachable!("leaf and pair with the same free bits")
+                    }
+                },
+                // the new subtree is under one child of the old pair
+                Ordering::Greater => {
+                    let height = old_branch.fork_height;
+                    if let NodeType::Pair(left, right) = old_branch.node_at(height) {
+                        if new_branch.key.get_bit(height) {
+                            self.push_children((left, right), (H256::zero(), new));
+                        } else {
+                            self.push_children((left, right), (new, H256::zero()));
+                        }
+                    }
+                }
+                // the old subtree is under one child of the new pair
+                Ordering::Less => {
+                    let height = new_branch.fork_height;
+                    if let NodeType::Pair(left, right) = new_branch.node_at(height) {
+                        if old_branch.key.get_bit(height) {
+                            self.push_children((H256::zero(), old), (left, right));
+                        } else {
+                            self.push_children((old, H256::zero()), (left, right));
+                        }
+                    }
+                }
+            }
+        }
+        Ok(None)
+    }
+}
+
+impl<'a, V, S: Store<V>> Iterator for DiffIter<'a, V, S> {
+    type Item = Result<(H256, Option<V>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match self.next_change() {
+            Ok(change) => change.map(Ok),
+            Err(err) => {
+                self.stack.clear();
+                Some(Err(err))
+            }
+        }
+    }
+}
+
+/// Return the inclusive range of keys which start with the highest len bits of prefix
+pub(crate) fn prefix_range(prefix: &H256, len: u16) -> (Bound<H256>, Bound<H256>) {
+    assert!(len <= 256, "prefix length {} is larger than 256", len);
+    let (min, max) = subtree_range(prefix, 256 - len);
+    (Bound::Included(min), Bound::Included(max))
+}
+
+/// Return the owned bounds of range
+pub(crate) fn range_bounds<R: RangeBounds<H256>>(range: &R) -> (Bound<H256>, Bound<H256>) {
+    fn owned(bound: Bound<&H256>) -> Bound<H256> {
+        match bound {
+            Bound::Included(key) => Bound::Included(*key),
+            Bound::Excluded(key) => Bound::Excluded(*key),
+            Bound::Unbounded => Bound::Unbounded,
+        }
+    }
+    (owned(range.start_bound()), owned(range.end_bound()))
+}
@@ -61,21 +61,38 @@
 
 #![cfg_attr(not(feature = "std"), no_std)]
 
+pub mod arena_store;
+#[cfg(feature = "async")]
+pub mod async_store;
 #[cfg(feature = "blake2b")]
 pub mod blake2b;
+pub mod caching_store;
 pub mod default_store;
+pub mod deferred_tree;
 pub mod error;
 pub mod h256;
+pub mod iter;
 pub mod merge;
 pub mod merkle_proof;
+pub mod metrics;
+pub mod overlay_store;
+pub mod packed;
+pub mod packed_proof;
+pub mod persistent_store;
+#[cfg(feature = "std")]
+pub mod shared_store;
+pub mod snapshot_store;
 #[cfg(test)]
 mod tests;
 pub mod traits;
 pub mod tree;
+pub mod tree_diff;
 
+pub use deferred_tree::DeferredTree;
 pub use h256::H256;
-pub use merkle_proof::{CompiledMerkleProof, MerkleProof};
+pub use merkle_proof::{CompiledMerkleProof, MerkleProof, RangeProof};
 pub use tree::SparseMerkleTree;
+pub use tree_diff::TreeDiff;
 
 /// Expected path size: log2(256) * 2, used for hint vector capacity
 pub const EXPECTED_PATH_SIZE: usize = 16;
@@ -84,11 +101,17 @@ pub(crate) const MAX_STACK_SIZE: usize = 257;
 
 cfg_if::cfg_if! {
     if #[cfg(feature = "std")] {
+        use std::borrow;
+        #[cfg(feature = "async")]
+        use std::boxed;
         use std::collections;
         use std::vec;
         use std::string;
     } else {
         extern crate alloc;
+        use alloc::borrow;
+        #[cfg(feature = "async")]
+        use alloc::boxed;
         use alloc::collections;
         use alloc::vec;
         use alloc::string;
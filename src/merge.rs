@@ -10,10 +10,7 @@ pub fn merge<H: Hasher + Default>(lhs: &H256, rhs: &H256) -> H256 {
     } else if rhs.is_zero() {
         return *lhs;
     }
-    let mut hasher = H::default();
-    hasher.write_h256(lhs);
-    hasher.write_h256(rhs);
-    hasher.finish()
+    H::hash_pair(lhs, rhs)
 }
 
 /// hash_leaf = hash(key | value)
@@ -22,8 +19,5 @@ pub fn hash_leaf<H: Hasher + Default>(key: &H256, value: &H256) -> H256 {
     if value.is_zero() {
         return H256::zero();
     }
-    let mut hasher = H::default();
-    hasher.write_h256(key);
-    hasher.write_h256(value);
-    hasher.finish()
+    H::hash_pair(key, value)
 }
@@ -1,13 +1,14 @@
 use crate::{
-    collections::{BTreeMap, VecDeque},
+    collections::{BTreeMap, BinaryHeap, VecDeque},
+    default_store::Map,
     error::{Error, Result},
     merge::{hash_leaf, merge},
     traits::Hasher,
+    tree::{compile_merkle_paths, MerklePaths},
     vec::Vec,
     H256, MAX_STACK_SIZE,
 };
-
-type Range = core::ops::Range<usize>;
+use core::cmp::Reverse;
 
 #[derive(Debug, Clone, PartialEq, Eq)]
 pub struct MerkleProof {
@@ -45,82 +46,8 @@ impl MerkleProof {
     }
 
     /// convert merkle proof into CompiledMerkleProof
-    pub fn compile(self, mut leaves: Vec<(H256, H256)>) -> Result<CompiledMerkleProof> {
-        if leaves.is_empty() {
-            return Err(Error::EmptyKeys);
-        } else if leaves.len() != self.leaves_count() {
-            return Err(Error::IncorrectNumberOfLeaves {
-                expected: self.leaves_count(),
-                actual: leaves.len(),
-            });
-        }
-
-        let (leaves_path, proof) = self.take();
-        let mut leaves_path: Vec<VecDeque<_>> = leaves_path.into_iter().map(Into::into).collect();
-        let mut proof: VecDeque<_> = proof.into();
-
-        // sort leaves
-        leaves.sort_unstable_by_key(|(k, _v)| *k);
-        // tree_buf: (height, key) -> (key_index, node)
-        let mut tree_buf: BTreeMap<_, _> = leaves
-            .into_iter()
-            .enumerate()
-            .map(|(i, (k, _v))| ((0, k), (i, leaf_program(i))))
-            .collect();
-        // rebuild the tree from bottom to top
-        while !tree_buf.is_empty() {
-            // pop_front from tree_buf, the API is unstable
-            let &(mut height, key) = tree_buf.keys().next().unwrap();
-            let (leaf_index, program) = tree_buf.remove(&(height, key)).unwrap();
-
-            if proof.is_empty() && tree_buf.is_empty() {
-                return Ok(CompiledMerkleProof(program.0));
-            }
-
-            let mut sibling_key = key.parent_path(height);
-            if !key.get_bit(height) {
-                sibling_key.set_bit(height)
-            }
-
-            let (parent_key, parent_program, height) =
-                if Some(&(height, sibling_key)) == tree_buf.keys().next() {
-                    let (_leaf_index, sibling_program) = tree_buf
-                        .remove(&(height, sibling_key))
-                        .expect("pop sibling");
-                    let parent_key = key.parent_path(height);
-                    let parent_program = merge_program(&program, &sibling_program, height)?;
-                    (parent_key, parent_program, height)
-                } else {
-                    let merge_height = leaves_path[leaf_index].front().copied().unwrap_or(height);
-                    if height != merge_height {
-                        let parent_key = key.copy_bits(merge_height);
-                        // skip zeros
-                        tree_buf.insert((merge_height, parent_key), (leaf_index, program));
-                        continue;
-                    }
-                    let (proof, proof_height) = proof.pop_front().ok_or(Error::CorruptedProof)?;
-                    let proof_height = proof_height;
-                    if height < proof_height {
-                        height = proof_height;
-                    }
-
-                    let parent_key = key.parent_path(height);
-                    let parent_program = proof_program(&program, proof, height);
-                    (parent_key, parent_program, height)
-                };
-
-            if height == core::u8::MAX {
-                if proof.is_empty() {
-                    return Ok(CompiledMerkleProof(parent_program.0));
-                } else {
-                    return Err(Error::CorruptedProof);
-                }
-            }
-            leaves_path[leaf_index].pop_front();
-            tree_buf.insert((height + 1, parent_key), (leaf_index, parent_program));
-        }
-
-        Err(Error::CorruptedProof)
+    pub fn compile(self, leaves: Vec<(H256, H256)>) -> Result<CompiledMerkleProof> {
+        compile_proof(leaves, &self.leaves_path, self.proof.iter().copied())
     }
 
     /// Compute root from proof
@@ -227,70 +154,207 @@ impl MerkleProof {
     }
 }
 
-fn leaf_program(leaf_index: usize) -> (Vec<u8>, Option<Range>) {
-    let mut program = Vec::with_capacity(1);
-    program.push(0x4C);
-    (
-        program,
-        Some(Range {
-            start: leaf_index,
-            end: leaf_index + 1,
-        }),
-    )
+/// Heights of non-zero siblings of each leaf, in the order of leaves
+pub(crate) trait LeavesPath {
+    fn leaves_count(&self) -> usize;
+    /// The index-th height of the leaf
+    fn height(&self, leaf_index: usize, index: usize) -> Option<u8>;
 }
 
-fn proof_program(
-    child: &(Vec<u8>, Option<Range>),
-    proof: H256,
-    height: u8,
-) -> (Vec<u8>, Option<Range>) {
-    let (child_program, child_range) = child;
-    let mut program = Vec::new();
-    program.resize(34 + child_program.len(), 0x50);
-    program[..child_program.len()].copy_from_slice(child_program);
-    program[child_program.len() + 1] = height;
-    program[child_program.len() + 2..].copy_from_slice(proof.as_slice());
-    (program, child_range.clone())
+impl LeavesPath for Vec<Vec<u8>> {
+    fn leaves_count(&self) -> usize {
+        self.len()
+    }
+    fn height(&self, leaf_index: usize, index: usize) -> Option<u8> {
+        self[leaf_index].get(index).copied()
+    }
+}
+
+/// Compile a merkle proof of unsorted leaves
+pub(crate) fn compile_proof<P: LeavesPath, I: ExactSizeIterator<Item = (H256, u8)>>(
+    mut leaves: Vec<(H256, H256)>,
+    leaves_path: &P,
+    proof: I,
+) -> Result<CompiledMerkleProof> {
+    if leaves.is_empty() {
+        return Err(Error::EmptyKeys);
+    } else if leaves.len() != leaves_path.leaves_count() {
+        return Err(Error::IncorrectNumberOfLeaves {
+            expected: leaves_path.leaves_count(),
+            actual: leaves.len(),
+        });
+    }
+
+    // sort leaves
+    leaves.sort_unstable_by_key(|(k, _v)| *k);
+    for pair in leaves.windows(2) {
+        if pair[0].0 == pair[1].0 {
+            return Err(Error::UnsortedKeys(pair[1].0));
+        }
+    }
+    let mut compiler = ProofCompiler::new(&leaves);
+    compiler.run(leaves_path, proof)?;
+    Ok(CompiledMerkleProof(compiler.emit()))
 }
 
-fn merge_program(
-    a: &(Vec<u8>, Option<Range>),
-    b: &(Vec<u8>, Option<Range>),
+/// A subtree of the proof being compiled
+struct CompileNode {
+    /// height of the next merge
     height: u8,
-) -> Result<(Vec<u8>, Option<Range>)> {
-    let (a_program, a_range) = a;
-    let (b_program, b_range) = b;
-    let (a_comes_first, range) = if a_range.is_none() || b_range.is_none() {
-        let range = if a_range.is_none() { b_range } else { a_range }
-            .clone()
-            .unwrap();
-        (true, range)
-    } else {
-        let a_range = a_range.clone().unwrap();
-        let b_range = b_range.clone().unwrap();
-        if a_range.end == b_range.start {
-            (
-                true,
-                Range {
-                    start: a_range.start,
-                    end: b_range.end,
-                },
-            )
-        } else {
-            return Err(Error::NonMergableRange);
+    key: H256,
+    /// index of the last leaf in the subtree
+    end: usize,
+    /// index of the next alive subtree
+    next: usize,
+    /// consumed heights of leaves_path
+    path_index: usize,
+}
+
+/// Compile opcode of a subtree, the subtree is identified by it's last leaf
+enum CompileOp {
+    Proof(u8, H256),
+    Merge(u8),
+}
+
+/// Compile proof by rebuilding the tree from bottom to top
+///
+/// Subtrees are merged in (height, key) order to consume the proof in order.
+/// Subtrees are indexed by their first leaf, so the index order is the key order.
+/// The program is the postorder of the rebuilt tree: after the `L` of a leaf,
+/// come the opcodes of the subtrees ending with that leaf, from bottom to top.
+struct ProofCompiler {
+    nodes: Vec<CompileNode>,
+    /// (end, op) in the order of execution
+    ops: Vec<(usize, CompileOp)>,
+}
+
+impl ProofCompiler {
+    fn new(leaves: &[(H256, H256)]) -> Self {
+        let nodes = leaves
+            .iter()
+            .enumerate()
+            .map(|(i, (key, _value))| CompileNode {
+                height: 0,
+                key: *key,
+                end: i,
+                next: i + 1,
+                path_index: 0,
+            })
+            .collect();
+        ProofCompiler {
+            nodes,
+            ops: Vec::new(),
+        }
+    }
+
+    fn run<P: LeavesPath, I: ExactSizeIterator<Item = (H256, u8)>>(
+        &mut self,
+        leaves_path: &P,
+        mut proof: I,
+    ) -> Result<()> {
+        let mut queue: BinaryHeap<Reverse<(u8, usize)>> =
+            (0..self.nodes.len()).map(|i| Reverse((0, i))).collect();
+        while let Some(Reverse((mut height, index))) = queue.pop() {
+            if proof.len() == 0 && queue.is_empty() {
+                return Ok(());
+            }
+
+            let node = &self.nodes[index];
+            let key = node.key;
+            let mut sibling_key = key.parent_path(height);
+            if !key.get_bit(height) {
+                sibling_key.set_bit(height)
+            }
+
+            let sibling = match queue.peek() {
+                Some(Reverse((sibling_height, sibling_index)))
+                    if *sibling_height == height
+                        && self.nodes[*sibling_index].key == sibling_key =>
+                {
+                    if *sibling_index != node.next {
+                        return Err(Error::NonMergableRange);
+                    }
+                    Some(*sibling_index)
+                }
+                _ => None,
+            };
+            if let Some(sibling_index) = sibling {
+                queue.pop();
+                let (end, next) = {
+                    let sibling = &self.nodes[sibling_index];
+                    (sibling.end, sibling.next)
+                };
+                let node = &mut self.nodes[index];
+                node.end = end;
+                node.next = next;
+                self.ops.push((end, CompileOp::Merge(height)));
+            } else {
+                let merge_height = leaves_path.height(index, node.path_index).unwrap_or(height);
+                if height != merge_height {
+                    // skip zeros
+                    let node = &mut self.nodes[index];
+                    node.key = key.copy_bits(merge_height);
+                    node.height = merge_height;
+                    queue.push(Reverse((merge_height, index)));
+                    continue;
+                }
+                let (proof, proof_height) = proof.next().ok_or(Error::CorruptedProof)?;
+                if height < proof_height {
+                    height = proof_height;
+                }
+                self.ops.push((node.end, CompileOp::Proof(height, proof)));
+            }
+
+            if height == core::u8::MAX {
+                if proof.len() == 0 && queue.is_empty() {
+                    return Ok(());
+                } else {
+                    return Err(Error::CorruptedProof);
+                }
+            }
+            let node = &mut self.nodes[index];
+            node.path_index += 1;
+            node.key = key.parent_path(height);
+            node.height = height + 1;
+            queue.push(Reverse((height + 1, index)));
+        }
+
+        Err(Error::CorruptedProof)
+    }
+
+    /// Write the program in postorder
+    fn emit(mut self) -> Vec<u8> {
+        // sort_by_key is stable, the opcodes of a subtree keeps the order of execution
+        self.ops.sort_by_key(|(end, _op)| *end);
+        let size = self.nodes.len()
+            + self
+                .ops
+                .iter()
+                .map(|(_end, op)| match op {
+                    CompileOp::Proof(..) => 34,
+                    CompileOp::Merge(..) => 2,
+                })
+                .sum::<usize>();
+        let mut program = Vec::with_capacity(size);
+        let mut ops = self.ops.iter().peekable();
+        for leaf_index in 0..self.nodes.len() {
+            program.push(0x4C);
+            while let Some((_end, op)) = ops.next_if(|(end, _op)| *end == leaf_index) {
+                match op {
+                    CompileOp::Proof(height, proof) => {
+                        program.push(0x50);
+                        program.push(*height);
+                        program.extend_from_slice(proof.as_slice());
+                    }
+                    CompileOp::Merge(height) => {
+                        program.push(0x48);
+                        program.push(*height);
+                    }
+                }
+            }
         }
-    };
-    let mut program = Vec::new();
-    program.resize(2 + a_program.len() + b_program.len(), 0x48);
-    if a_comes_first {
-        program[..a_program.len()].copy_from_slice(a_program);
-        program[a_program.len()..a_program.len() + b_program.len()].copy_from_slice(b_program);
-    } else {
-        program[..b_program.len()].copy_from_slice(b_program);
-        program[b_program.len()..a_program.len() + b_program.len()].copy_from_slice(a_program);
-    }
-    program[a_program.len() + b_program.len() + 1] = height;
-    Ok((program, Some(range)))
+        program
+    }
 }
 
 /// An structure optimized for verify merkle proof
@@ -300,63 +364,446 @@ pub struct CompiledMerkleProof(pub Vec<u8>);
 impl CompiledMerkleProof {
     pub fn compute_root<H: Hasher + Default>(&self, mut leaves: Vec<(H256, H256)>) -> Result<H256> {
         leaves.sort_unstable_by_key(|(k, _v)| *k);
-        let mut program_index = 0;
-        let mut leave_index = 0;
-        let mut stack = Vec::new();
-        while program_index < self.0.len() {
-            let code = self.0[program_index];
-            program_index += 1;
+        execute_compiled_proof::<H>(&self.0, &leaves)
+    }
+
+    pub fn verify<H: Hasher + Default>(
+        &self,
+        root: &H256,
+        leaves: Vec<(H256, H256)>,
+    ) -> Result<bool> {
+        let calculated_root = self.compute_root::<H>(leaves)?;
+        Ok(&calculated_root == root)
+    }
+
+    /// Same as `compute_root` but without heap allocation, see `compute_compiled_root`
+    pub fn compute_root_sorted<H: Hasher + Default>(
+        &self,
+        leaves: &[(H256, H256)],
+    ) -> Result<H256> {
+        compute_compiled_root::<H>(&self.0, leaves)
+    }
+
+    /// Same as `verify` but without heap allocation, see `compute_compiled_root`
+    pub fn verify_sorted<H: Hasher + Default>(
+        &self,
+        root: &H256,
+        leaves: &[(H256, H256)],
+    ) -> Result<bool> {
+        let calculated_root = self.compute_root_sorted::<H>(leaves)?;
+        Ok(&calculated_root == root)
+    }
+}
+
+/// A merkle proof of the leaves with consecutive keys
+///
+/// Leaves in a range are proved by the siblings on the boundary paths of the
+/// range, the siblings between the leaves are computed from the leaves. The
+/// proof size and the sibling lookups scale with the boundaries, not with the
+/// number of leaves. The proof is compiled into the same program as
+/// `SparseMerkleTree::compiled_merkle_proof` of the leaves before execution.
+///
+/// Siblings in `left` must be left of the first leaf or above all leaves, and
+/// siblings in `right` must be right of the last leaf, so a verified proof
+/// shows the leaves are all the leaves of the tree from the first key to the
+/// last key. It does not show that no leaf lies between the bounds of a
+/// requested range and the first or the last leaf.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct RangeProof {
+    left: Vec<(u8, H256)>,
+    right: Vec<(u8, H256)>,
+}
+
+impl RangeProof {
+    /// Create RangeProof
+    /// left: (height, sibling) on the path of the first leaf, left of the leaves
+    /// or above all leaves, sorted by height.
+    /// right: (height, sibling) on the path of the last leaf right of the leaves,
+    /// sorted by height, it is empty for a single leaf.
+    pub fn new(left: Vec<(u8, H256)>, right: Vec<(u8, H256)>) -> Self {
+        RangeProof { left, right }
+    }
+
+    /// Destruct the structure, useful for serialization
+    pub fn take(self) -> (Vec<(u8, H256)>, Vec<(u8, H256)>) {
+        let RangeProof { left, right } = self;
+        (left, right)
+    }
+
+    pub fn left(&self) -> &[(u8, H256)] {
+        &self.left
+    }
+
+    pub fn right(&self) -> &[(u8, H256)] {
+        &self.right
+    }
+
+    /// Convert range proof into CompiledMerkleProof of the sorted leaves
+    pub fn compile(&self, leaves: &[(H256, H256)]) -> Result<CompiledMerkleProof> {
+        if leaves.is_empty() {
+            return Err(Error::EmptyKeys);
+        }
+        check_sorted_leaves(leaves)?;
+        if leaves.len() == 1 && !self.right.is_empty() {
+            return Err(Error::CorruptedProof);
+        }
+        for siblings in &[&self.left, &self.right] {
+            if siblings.windows(2).any(|pair| pair[0].0 >= pair[1].0) {
+                return Err(Error::CorruptedProof);
+            }
+        }
+        let keys: Vec<H256> = leaves.iter().map(|(key, _value)| *key).collect();
+        let (first, last) = (keys[0], keys[keys.len() - 1]);
+        // a sibling between the first and the last leaf would hide leaves in the range
+        if keys.len() > 1 {
+            let top = first.fork_height(&last);
+            let outside_left = |height: u8| first.get_bit(height) || height > top;
+            let outside_right = |height: u8| !last.get_bit(height) && height < top;
+            if self.left.iter().any(|(height, _)| !outside_left(*height))
+                || self.right.iter().any(|(height, _)| !outside_right(*height))
+            {
+                return Err(Error::CorruptedProof);
+            }
+        }
+        // (key_index, height, sibling), a sibling belongs to the first key
+        // of the subtree it is merged with
+        let mut siblings: Vec<(usize, u8, H256)> =
+            Vec::with_capacity(self.left.len() + self.right.len());
+        siblings.extend(
+            self.left
+                .iter()
+                .map(|(height, sibling)| (0, *height, *sibling)),
+        );
+        let mut key_index = keys.len() - 1;
+        for (height, sibling) in &self.right {
+            while key_index > 0 && keys[key_index - 1].fork_height(&last) < *height {
+                key_index -= 1;
+            }
+            siblings.push((key_index, *height, *sibling));
+        }
+        let paths = MerklePaths::new(keys.len(), siblings);
+        let (proof, siblings_count) = compile_merkle_paths(&keys, &paths);
+        // siblings not on the merged paths
+        if siblings_count != paths.siblings.len() {
+            return Err(Error::CorruptedProof);
+        }
+        Ok(proof)
+    }
+
+    /// Compute root from proof
+    /// leaves: a vector of (key, value) with consecutive keys
+    pub fn compute_root<H: Hasher + Default>(&self, mut leaves: Vec<(H256, H256)>) -> Result<H256> {
+        leaves.sort_unstable_by_key(|(k, _v)| *k);
+        let proof = self.compile(&leaves)?;
+        execute_compiled_proof::<H>(&proof.0, &leaves)
+    }
+
+    /// Verify range proof
+    /// see compute_root
+    pub fn verify<H: Hasher + Default>(
+        &self,
+        root: &H256,
+        leaves: Vec<(H256, H256)>,
+    ) -> Result<bool> {
+        let calculated_root = self.compute_root::<H>(leaves)?;
+        Ok(&calculated_root == root)
+    }
+}
+
+/// Compute root from a compiled proof without heap allocation
+///
+/// leaves must be sorted by key in ascending order without duplicated keys,
+/// otherwise return UnsortedKeys error.
+/// The proof is executed on a fixed stack of `MAX_STACK_SIZE` entries.
+pub fn compute_compiled_root<H: Hasher + Default>(
+    program: &[u8],
+    leaves: &[(H256, H256)],
+) -> Result<H256> {
+    check_sorted_leaves(leaves)?;
+    execute_compiled_proof::<H>(program, leaves)
+}
+
+/// Verify many compiled proofs against one root
+///
+/// proofs are (program, leaves), leaves must be sorted like `compute_compiled_root`.
+/// Proofs are executed in lockstep: each round, the pending hashes of all
+/// proofs are hashed with one `Hasher::hash_pairs` call, and the hashes
+/// shared by proofs, such as nodes near the root, are computed only once.
+/// Return the verify result of each proof.
+pub fn verify_compiled_proofs<H: Hasher + Default>(
+    root: &H256,
+    proofs: &[(&[u8], &[(H256, H256)])],
+) -> Vec<Result<bool>> {
+    let mut results: Vec<Option<Result<bool>>> = Vec::with_capacity(proofs.len());
+    results.resize_with(proofs.len(), Default::default);
+    // (proof_index, vm)
+    let mut vms: Vec<(usize, ProofVm<Vec<(H256, H256)>>)> = Vec::with_capacity(proofs.len());
+    for (i, (program, leaves)) in proofs.iter().enumerate() {
+        match check_sorted_leaves(leaves) {
+            Ok(()) => vms.push((i, ProofVm::new(program, leaves, Vec::new()))),
+            Err(err) => results[i] = Some(Err(err)),
+        }
+    }
+
+    // (lhs, rhs) -> hash
+    let mut memo: Map<(H256, H256), H256> = Map::default();
+    // (vm_index, lhs, rhs)
+    let mut requests: Vec<(usize, H256, H256)> = Vec::with_capacity(vms.len());
+    let mut pairs: Vec<(H256, H256)> = Vec::new();
+    let mut hashes: Vec<H256> = Vec::new();
+    let mut answers: Vec<Option<H256>> = Vec::new();
+    answers.resize(vms.len(), None);
+    while !vms.is_empty() {
+        requests.clear();
+        for (vm_index, (proof_index, vm)) in vms.iter_mut().enumerate() {
+            match vm.resume(answers[vm_index].take()) {
+                VmState::Hash(lhs, rhs) => requests.push((vm_index, lhs, rhs)),
+                VmState::Done(result) => {
+                    results[*proof_index] =
+                        Some(result.map(|calculated_root| &calculated_root == root))
+                }
+            }
+        }
+        pairs.clear();
+        for (_vm_index, lhs, rhs) in &requests {
+            if !memo.contains_key(&(*lhs, *rhs)) {
+                pairs.push((*lhs, *rhs));
+            }
+        }
+        pairs.sort_unstable();
+        pairs.dedup();
+        hashes.clear();
+        hashes.resize(pairs.len(), H256::zero());
+        H::hash_pairs(&pairs, &mut hashes);
+        memo.extend(pairs.iter().copied().zip(hashes.iter().copied()));
+
+        // keep vms which requested a hash
+        let mut next_vms = Vec::with_capacity(requests.len());
+        answers.clear();
+        for (vm_index, vm) in vms.into_iter().enumerate() {
+            if let Some(hash) = requests
+                .get(next_vms.len())
+                .filter(|(request_index, _lhs, _rhs)| *request_index == vm_index)
+                .map(|(_vm_index, lhs, rhs)| memo[&(*lhs, *rhs)])
+            {
+                next_vms.push(vm);
+                answers.push(Some(hash));
+            }
+        }
+        vms = next_vms;
+    }
+    results
+        .into_iter()
+        .map(|result| result.expect("verify result"))
+        .collect()
+}
+
+/// Proofs verified on one thread
+#[cfg(feature = "rayon")]
+const PARALLEL_MIN_PROOFS: usize = 64;
+
+/// Parallel version of `verify_compiled_proofs`,
+/// proofs are split into chunks which are verified on the rayon thread pool
+#[cfg(feature = "rayon")]
+pub fn par_verify_compiled_proofs<H: Hasher + Default>(
+    root: &H256,
+    proofs: &[(&[u8], &[(H256, H256)])],
+) -> Vec<Result<bool>> {
+    if proofs.len() < PARALLEL_MIN_PROOFS * 2 {
+        return verify_compiled_proofs::<H>(root, proofs);
+    }
+    let (left, right) = proofs.split_at(proofs.len() / 2);
+    let (mut left, right) = rayon::join(
+        || par_verify_compiled_proofs::<H>(root, left),
+        || par_verify_compiled_proofs::<H>(root, right),
+    );
+    left.extend(right);
+    left
+}
+
+fn check_sorted_leaves(leaves: &[(H256, H256)]) -> Result<()> {
+    for pair in leaves.windows(2) {
+        if pair[0].0 >= pair[1].0 {
+            return Err(Error::UnsortedKeys(pair[1].0));
+        }
+    }
+    Ok(())
+}
+
+/// Run compiled proof with sorted leaves
+fn execute_compiled_proof<H: Hasher + Default>(
+    program: &[u8],
+    leaves: &[(H256, H256)],
+) -> Result<H256> {
+    let mut vm = ProofVm::new(
+        program,
+        leaves,
+        ArrayStack([(H256::zero(), H256::zero()); MAX_STACK_SIZE], 0),
+    );
+    let mut hash = None;
+    loop {
+        match vm.resume(hash) {
+            VmState::Hash(lhs, rhs) => hash = Some(H::hash_pair(&lhs, &rhs)),
+            VmState::Done(result) => return result,
+        }
+    }
+}
+
+/// Stack of compiled proof vm, contains (key, node)
+trait VmStack {
+    fn len(&self) -> usize;
+    fn push(&mut self, item: (H256, H256));
+    fn pop(&mut self) -> Option<(H256, H256)>;
+}
+
+impl VmStack for Vec<(H256, H256)> {
+    fn len(&self) -> usize {
+        Vec::len(self)
+    }
+    fn push(&mut self, item: (H256, H256)) {
+        Vec::push(self, item)
+    }
+    fn pop(&mut self) -> Option<(H256, H256)> {
+        Vec::pop(self)
+    }
+}
+
+/// Fixed size stack, the second field is the length
+struct ArrayStack([(H256, H256); MAX_STACK_SIZE], usize);
+
+impl VmStack for ArrayStack {
+    fn len(&self) -> usize {
+        self.1
+    }
+    fn push(&mut self, item: (H256, H256)) {
+        self.0[self.1] = item;
+        self.1 += 1;
+    }
+    fn pop(&mut self) -> Option<(H256, H256)> {
+        self.1 = self.1.checked_sub(1)?;
+        Some(self.0[self.1])
+    }
+}
+
+enum VmState {
+    /// Resume the vm with the hash of (lhs, rhs)
+    Hash(H256, H256),
+    Done(Result<H256>),
+}
+
+/// A resumable vm of compiled proof, hashing is done by the caller
+struct ProofVm<'a, S> {
+    program: &'a [u8],
+    leaves: &'a [(H256, H256)],
+    program_index: usize,
+    leave_index: usize,
+    stack: S,
+    /// key of the node which is waiting for hash
+    pending_key: H256,
+}
+
+impl<'a, S: VmStack> ProofVm<'a, S> {
+    fn new(program: &'a [u8], leaves: &'a [(H256, H256)], stack: S) -> Self {
+        ProofVm {
+            program,
+            leaves,
+            program_index: 0,
+            leave_index: 0,
+            stack,
+            pending_key: H256::zero(),
+        }
+    }
+
+    /// Push a merged node, return the hash request if both sides are non-zero
+    fn merge(&mut self, key: H256, lhs: H256, rhs: H256) -> Option<VmState> {
+        if lhs.is_zero() {
+            self.stack.push((key, rhs));
+        } else if rhs.is_zero() {
+            self.stack.push((key, lhs));
+        } else {
+            self.pending_key = key;
+            return Some(VmState::Hash(lhs, rhs));
+        }
+        None
+    }
+
+    /// Run until a hash is required, hash is the requested hash of last call
+    fn resume(&mut self, hash: Option<H256>) -> VmState {
+        if let Some(hash) = hash {
+            self.stack.push((self.pending_key, hash));
+        }
+        match self.run() {
+            Ok(Some(state)) => state,
+            Ok(None) => {
+                if self.stack.len() != 1 {
+                    return VmState::Done(Err(Error::CorruptedStack));
+                }
+                VmState::Done(Ok(self.stack.pop().expect("root").1))
+            }
+            Err(err) => VmState::Done(Err(err)),
+        }
+    }
+
+    fn run(&mut self) -> Result<Option<VmState>> {
+        let program = self.program;
+        while self.program_index < program.len() {
+            let code = program[self.program_index];
+            self.program_index += 1;
             match code {
                 // L
                 0x4C => {
-                    if leave_index >= leaves.len() {
+                    if self.leave_index >= self.leaves.len() || self.stack.len() >= MAX_STACK_SIZE {
                         return Err(Error::CorruptedStack);
                     }
-                    let (k, v) = leaves[leave_index];
+                    let (k, v) = self.leaves[self.leave_index];
 
                     // Deny non-inclusion proof
                     if v.is_zero() {
                         return Err(Error::ForbidZeroValueLeaf);
                     }
 
-                    stack.push((k, hash_leaf::<H>(&k, &v)));
-                    leave_index += 1;
+                    self.leave_index += 1;
+                    // hash_leaf
+                    self.pending_key = k;
+                    return Ok(Some(VmState::Hash(k, v)));
                 }
                 // P
                 0x50 => {
-                    if stack.is_empty() {
+                    if self.stack.len() == 0 {
                         return Err(Error::CorruptedStack);
                     }
-                    if program_index + 33 > self.0.len() {
+                    if self.program_index + 33 > program.len() {
                         return Err(Error::CorruptedProof);
                     }
-                    let height = self.0[program_index];
-                    program_index += 1;
+                    let height = program[self.program_index];
+                    self.program_index += 1;
                     let mut data = [0u8; 32];
-                    data.copy_from_slice(&self.0[program_index..program_index + 32]);
-                    program_index += 32;
+                    data.copy_from_slice(&program[self.program_index..self.program_index + 32]);
+                    self.program_index += 32;
                     let proof = H256::from(data);
-                    let (key, value) = stack.pop().unwrap();
+                    let (key, value) = self.stack.pop().expect("stack top");
                     let parent_key = key.parent_path(height);
-                    let parent = if key.get_bit(height) {
-                        merge::<H>(&proof, &value)
+                    let state = if key.get_bit(height) {
+                        self.merge(parent_key, proof, value)
                     } else {
-                        merge::<H>(&value, &proof)
+                        self.merge(parent_key, value, proof)
                     };
-                    stack.push((parent_key, parent));
+                    if state.is_some() {
+                        return Ok(state);
+                    }
                 }
                 // H
                 0x48 => {
-                    if stack.len() < 2 {
+                    if self.stack.len() < 2 {
                         return Err(Error::CorruptedStack);
                     }
-                    if program_index >= self.0.len() {
+                    if self.program_index >= program.len() {
                         return Err(Error::CorruptedProof);
                     }
-                    let height = self.0[program_index];
-                    program_index += 1;
-                    let (key_b, value_b) = stack.pop().unwrap();
-                    let (key_a, value_a) = stack.pop().unwrap();
+                    let height = program[self.program_index];
+                    self.program_index += 1;
+                    let (key_b, value_b) = self.stack.pop().expect("stack top");
+                    let (key_a, value_a) = self.stack.pop().expect("stack top");
                     let parent_key_a = key_a.copy_bits(height);
                     let parent_key_b = key_b.copy_bits(height);
                     let a_set = key_a.get_bit(height);
@@ -369,30 +816,19 @@ impl CompiledMerkleProof {
                     if !(sibling_key_a == parent_key_b && (a_set ^ b_set)) {
                         return Err(Error::NonSiblings);
                     }
-                    let parent = if key_a.get_bit(height) {
-                        merge::<H>(&value_b, &value_a)
+                    let state = if key_a.get_bit(height) {
+                        self.merge(parent_key_a, value_b, value_a)
                     } else {
-                        merge::<H>(&value_a, &value_b)
+                        self.merge(parent_key_a, value_a, value_b)
                     };
-                    stack.push((parent_key_a, parent));
+                    if state.is_some() {
+                        return Ok(state);
+                    }
                 }
                 _ => return Err(Error::InvalidCode(code)),
             }
-            debug_assert!(stack.len() <= MAX_STACK_SIZE);
-        }
-        if stack.len() != 1 {
-            return Err(Error::CorruptedStack);
         }
-        Ok(stack[0].1)
-    }
-
-    pub fn verify<H: Hasher + Default>(
-        &self,
-        root: &H256,
-        leaves: Vec<(H256, H256)>,
-    ) -> Result<bool> {
-        let calculated_root = self.compute_root::<H>(leaves)?;
-        Ok(&calculated_root == root)
+        Ok(None)
     }
 }
 
@@ -0,0 +1,212 @@
+//! Opt-in counters of store accesses and hashes
+//!
+//! Wrap the store by `InstrumentedStore` and the hasher by `CountingHasher`
+//! to count the work of tree operations, trees without the wrappers are not
+//! affected. Store counters are relaxed atomics, cheap to increment and
+//! shareable between threads. With the `std` feature hashes are counted per
+//! thread, so counts of a call are not mixed with other threads.
+//!
+//! Call `InstrumentedStore::take_stats` and `take_hash_count` after an
+//! operation to get its counters. Traversal depth of the operation is
+//! `branch_reads` for `get` and `update` which read one branch per height,
+//! and `batch_reads` for `merkle_proof` and `update_all` which read one
+//! level of the tree per call.
+
+use crate::{
+    borrow::Cow,
+    error::Error,
+    traits::{Hasher, Store},
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+/// Counters of store accesses
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct StoreStats {
+    /// Branches read by single and batched reads
+    pub branch_reads: usize,
+    /// Leaves read by single and batched reads
+    pub leaf_reads: usize,
+    /// Calls of `get_branches` and `get_leaves`
+    pub batch_reads: usize,
+    pub branch_inserts: usize,
+    pub leaf_inserts: usize,
+    pub branch_removes: usize,
+    pub leaf_removes: usize,
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    branch_reads: AtomicUsize,
+    leaf_reads: AtomicUsize,
+    batch_reads: AtomicUsize,
+    branch_inserts: AtomicUsize,
+    leaf_inserts: AtomicUsize,
+    branch_removes: AtomicUsize,
+    leaf_removes: AtomicUsize,
+}
+
+fn incr(counter: &AtomicUsize, n: usize) {
+    counter.fetch_add(n, Ordering::Relaxed);
+}
+
+/// A store counting accesses of the inner store
+#[derive(Debug, Default)]
+pub struct InstrumentedStore<S> {
+    inner: S,
+    counters: Counters,
+}
+
+impl<S> InstrumentedStore<S> {
+    pub fn new(inner: S) -> Self {
+        InstrumentedStore {
+            inner,
+            counters: Default::default(),
+        }
+    }
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+    /// Counters since the store is created or the last `take_stats`
+    pub fn stats(&self) -> StoreStats {
+        let c = &self.counters;
+        let load = |counter: &AtomicUsize| counter.load(Ordering::Relaxed);
+        StoreStats {
+            branch_reads: load(&c.branch_reads),
+            leaf_reads: load(&c.leaf_reads),
+            batch_reads: load(&c.batch_reads),
+            branch_inserts: load(&c.branch_inserts),
+            leaf_inserts: load(&c.leaf_inserts),
+            branch_removes: load(&c.branch_removes),
+            leaf_removes: load(&c.leaf_removes),
+        }
+    }
+    /// Return counters and reset them to zero
+    pub fn take_stats(&self) -> StoreStats {
+        let c = &self.counters;
+        let take = |counter: &AtomicUsize| counter.swap(0, Ordering::Relaxed);
+        StoreStats {
+            branch_reads: take(&c.branch_reads),
+            leaf_reads: take(&c.leaf_reads),
+            batch_reads: take(&c.batch_reads),
+            branch_inserts: take(&c.branch_inserts),
+            leaf_inserts: take(&c.leaf_inserts),
+            branch_removes: take(&c.branch_removes),
+            leaf_removes: take(&c.leaf_removes),
+        }
+    }
+}
+
+impl<S: Store<V>, V> Store<V> for InstrumentedStore<S> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        incr(&self.counters.branch_reads, 1);
+        self.inner.get_branch(node)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        incr(&self.counters.leaf_reads, 1);
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        incr(&self.counters.branch_reads, 1);
+        self.inner.get_branch_ref(node)
+    }
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error>
+    where
+        V: Clone,
+    {
+        incr(&self.counters.leaf_reads, 1);
+        self.inner.get_leaf_ref(leaf_hash)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        incr(&self.counters.batch_reads, 1);
+        incr(&self.counters.branch_reads, nodes.len());
+        self.inner.get_branches(nodes)
+    }
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<V>>>, Error> {
+        incr(&self.counters.batch_reads, 1);
+        incr(&self.counters.leaf_reads, leaf_hashes.len());
+        self.inner.get_leaves(leaf_hashes)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        incr(&self.counters.branch_inserts, 1);
+        self.inner.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        incr(&self.counters.leaf_inserts, 1);
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        incr(&self.counters.branch_removes, 1);
+        self.inner.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        incr(&self.counters.leaf_removes, 1);
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+#[cfg(feature = "std")]
+std::thread_local! {
+    static HASH_COUNT: core::cell::Cell<usize> = const { core::cell::Cell::new(0) };
+}
+
+// without std there is no thread local storage, the counter is global
+#[cfg(not(feature = "std"))]
+static HASH_COUNT: AtomicUsize = AtomicUsize::new(0);
+
+fn count_hashes(n: usize) {
+    #[cfg(feature = "std")]
+    HASH_COUNT.with(|count| count.set(count.get() + n));
+    #[cfg(not(feature = "std"))]
+    incr(&HASH_COUNT, n);
+}
+
+/// Number of hashes computed by `CountingHasher`s on the current thread
+/// since the last `take_hash_count`
+pub fn hash_count() -> usize {
+    #[cfg(feature = "std")]
+    return HASH_COUNT.with(|count| count.get());
+    #[cfg(not(feature = "std"))]
+    return HASH_COUNT.load(Ordering::Relaxed);
+}
+
+/// Return the number of hashes on the current thread and reset it to zero
+pub fn take_hash_count() -> usize {
+    #[cfg(feature = "std")]
+    return HASH_COUNT.with(|count| count.replace(0));
+    #[cfg(not(feature = "std"))]
+    return HASH_COUNT.swap(0, Ordering::Relaxed);
+}
+
+/// A hasher counting computed hashes
+///
+/// It counts the leaf hashes and merges of the tree and proofs,
+/// merges with a zero node do not compute hashes and are not counted.
+/// With the `std` feature the counter is thread local, hashes computed on
+/// other threads, such as the workers of `par_update_all`, are not counted.
+/// Without `std` the counter is shared by all trees.
+#[derive(Debug, Default)]
+pub struct CountingHasher<H>(H);
+
+impl<H: Hasher + Default> Hasher for CountingHasher<H> {
+    fn write_h256(&mut self, h: &H256) {
+        self.0.write_h256(h);
+    }
+    fn finish(self) -> H256 {
+        count_hashes(1);
+        self.0.finish()
+    }
+    fn hash_pair(lhs: &H256, rhs: &H256) -> H256 {
+        count_hashes(1);
+        H::hash_pair(lhs, rhs)
+    }
+    fn hash_pairs(pairs: &[(H256, H256)], outputs: &mut [H256]) {
+        count_hashes(pairs.len());
+        H::hash_pairs(pairs, outputs)
+    }
+}
@@ -0,0 +1,137 @@
+use crate::{
+    borrow::Cow,
+    default_store::Map,
+    error::Error,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    H256,
+};
+
+/// A write-back store layered over another store
+///
+/// Writes are buffered in memory and only the latest write of each node is kept,
+/// a node inserted then removed in the same batch of updates costs no write
+/// unless the inner store has it.
+/// Call `commit` to flush buffered writes into the inner store,
+/// or `rollback` to drop them; the tree's root must be reset by the caller after a rollback.
+#[derive(Debug, Clone, Default)]
+pub struct OverlayStore<S, V> {
+    inner: S,
+    // a `None` value marks a removed node
+    branches_map: Map<H256, Option<BranchNode>>,
+    leaves_map: Map<H256, Option<LeafNode<V>>>,
+}
+
+impl<S, V> OverlayStore<S, V> {
+    pub fn new(inner: S) -> Self {
+        OverlayStore {
+            inner,
+            branches_map: Default::default(),
+            leaves_map: Default::default(),
+        }
+    }
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+    /// Destroy the overlay and retake the inner store, buffered writes are dropped
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+    /// Buffered branches, `None` represents a removed branch
+    pub fn branches_map(&self) -> &Map<H256, Option<BranchNode>> {
+        &self.branches_map
+    }
+    /// Buffered leaves, `None` represents a removed leaf
+    pub fn leaves_map(&self) -> &Map<H256, Option<LeafNode<V>>> {
+        &self.leaves_map
+    }
+    /// Check if there are no buffered writes
+    pub fn is_clean(&self) -> bool {
+        self.branches_map.is_empty() && self.leaves_map.is_empty()
+    }
+    /// Drop all buffered writes
+    pub fn rollback(&mut self) {
+        self.branches_map.clear();
+        self.leaves_map.clear();
+    }
+}
+
+impl<S: Store<V>, V: Clone> OverlayStore<S, V> {
+    /// Flush buffered writes into the inner store
+    ///
+    /// Buffered writes are kept if the inner store returns an error,
+    /// writes are idempotent so commit can be retried.
+    pub fn commit(&mut self) -> Result<(), Error> {
+        for (node, branch) in self.branches_map.iter() {
+            match branch {
+                Some(branch) => self.inner.insert_branch(*node, branch.clone())?,
+                None => self.inner.remove_branch(node)?,
+            }
+        }
+        for (leaf_hash, leaf) in self.leaves_map.iter() {
+            match leaf {
+                Some(leaf) => self.inner.insert_leaf(*leaf_hash, leaf.clone())?,
+                None => self.inner.remove_leaf(leaf_hash)?,
+            }
+        }
+        self.rollback();
+        Ok(())
+    }
+}
+
+impl<S: Store<V>, V: Clone> Store<V> for OverlayStore<S, V> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        match self.branches_map.get(node) {
+            Some(branch) => Ok(branch.clone()),
+            None => self.inner.get_branch(node),
+        }
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        match self.leaves_map.get(leaf_hash) {
+            Some(leaf) => Ok(leaf.clone()),
+            None => self.inner.get_leaf(leaf_hash),
+        }
+    }
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        match self.branches_map.get(node) {
+            Some(branch) => Ok(branch.as_ref().map(Cow::Borrowed)),
+            None => self.inner.get_branch_ref(node),
+        }
+    }
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error> {
+        match self.leaves_map.get(leaf_hash) {
+            Some(leaf) => Ok(leaf.as_ref().map(Cow::Borrowed)),
+            None => self.inner.get_leaf_ref(leaf_hash),
+        }
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.branches_map.insert(node, Some(branch));
+        Ok(())
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        self.leaves_map.insert(leaf_hash, Some(leaf));
+        Ok(())
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        // drop a buffered insert instead of removing it from the inner store,
+        // only nodes inserted in this batch need the inner store lookup
+        if let Some(Some(_)) = self.branches_map.get(node) {
+            if self.inner.get_branch_ref(node)?.is_none() {
+                self.branches_map.remove(node);
+                return Ok(());
+            }
+        }
+        self.branches_map.insert(*node, None);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        if let Some(Some(_)) = self.leaves_map.get(leaf_hash) {
+            if self.inner.get_leaf_ref(leaf_hash)?.is_none() {
+                self.leaves_map.remove(leaf_hash);
+                return Ok(());
+            }
+        }
+        self.leaves_map.insert(*leaf_hash, None);
+        Ok(())
+    }
+}
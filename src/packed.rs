@@ -0,0 +1,184 @@
+//! Canonical fixed size encoding of tree nodes for on-disk stores
+//!
+//! A packed branch is a 97 bytes record:
+//!
+//! | offset | size | field                                   |
+//! | ------ | ---- | --------------------------------------- |
+//! | 0      | 1    | fork_height                             |
+//! | 1      | 32   | key                                     |
+//! | 33     | 32   | node                                    |
+//! | 65     | 32   | sibling, zero for `NodeType::Single`    |
+//!
+//! The tree never stores a zero node in a `NodeType::Pair`,
+//! so a zero sibling marks a `NodeType::Single` branch.
+//!
+//! A packed leaf is a `32 + V::PACKED_SIZE` bytes record, the key followed by the packed value.
+//!
+//! `PackedBranchNode` and `PackedLeafNode` read fields directly from a borrowed record,
+//! which suits memory mapped stores.
+
+use crate::{
+    error::{Error, Result},
+    tree::{BranchNode, LeafNode, NodeType},
+    H256,
+};
+use core::marker::PhantomData;
+
+/// Size of a packed branch
+pub const PACKED_BRANCH_SIZE: usize = 97;
+
+/// Trait for values with a fixed size encoding
+pub trait PackedValue: Sized {
+    /// Size of the packed value
+    const PACKED_SIZE: usize;
+    /// Write value into buf, buf.len() is `PACKED_SIZE`
+    fn pack_value(&self, buf: &mut [u8]);
+    /// Read value from buf, buf.len() is `PACKED_SIZE`
+    fn unpack_value(buf: &[u8]) -> Self;
+}
+
+impl PackedValue for H256 {
+    const PACKED_SIZE: usize = 32;
+    fn pack_value(&self, buf: &mut [u8]) {
+        buf.copy_from_slice(self.as_slice());
+    }
+    fn unpack_value(buf: &[u8]) -> Self {
+        read_h256(buf)
+    }
+}
+
+fn read_h256(buf: &[u8]) -> H256 {
+    let mut data = [0u8; 32];
+    data.copy_from_slice(&buf[..32]);
+    data.into()
+}
+
+impl BranchNode {
+    /// Encode the branch into a packed record
+    pub fn pack(&self) -> [u8; PACKED_BRANCH_SIZE] {
+        let mut buf = [0u8; PACKED_BRANCH_SIZE];
+        buf[0] = self.fork_height;
+        buf[1..33].copy_from_slice(self.key.as_slice());
+        match self.node_type {
+            NodeType::Single(node) => {
+                buf[33..65].copy_from_slice(node.as_slice());
+            }
+            NodeType::Pair(node, sibling) => {
+                debug_assert!(!sibling.is_zero(), "pair with a zero sibling");
+                buf[33..65].copy_from_slice(node.as_slice());
+                buf[65..].copy_from_slice(sibling.as_slice());
+            }
+        }
+        buf
+    }
+
+    /// Decode a branch from a packed record
+    pub fn unpack(buf: &[u8]) -> Result<Self> {
+        PackedBranchNode::from_slice(buf).map(|packed| packed.to_branch_node())
+    }
+}
+
+/// A borrowed packed branch
+#[derive(Debug, Clone, Copy)]
+pub struct PackedBranchNode<'a>(&'a [u8]);
+
+impl<'a> PackedBranchNode<'a> {
+    /// Wrap a packed record, return CorruptedNode error if size is mismatched
+    pub fn from_slice(buf: &'a [u8]) -> Result<Self> {
+        if buf.len() != PACKED_BRANCH_SIZE {
+            return Err(Error::CorruptedNode);
+        }
+        Ok(PackedBranchNode(buf))
+    }
+
+    pub fn as_slice(&self) -> &'a [u8] {
+        self.0
+    }
+
+    pub fn fork_height(&self) -> u8 {
+        self.0[0]
+    }
+
+    pub fn key(&self) -> H256 {
+        read_h256(&self.0[1..33])
+    }
+
+    pub fn node_type(&self) -> NodeType {
+        let node = read_h256(&self.0[33..65]);
+        let sibling = read_h256(&self.0[65..]);
+        if sibling.is_zero() {
+            NodeType::Single(node)
+        } else {
+            NodeType::Pair(node, sibling)
+        }
+    }
+
+    pub fn to_branch_node(&self) -> BranchNode {
+        BranchNode {
+            fork_height: self.fork_height(),
+            key: self.key(),
+            node_type: self.node_type(),
+        }
+    }
+}
+
+impl<V: PackedValue> LeafNode<V> {
+    /// Size of a packed leaf
+    pub const PACKED_SIZE: usize = 32 + V::PACKED_SIZE;
+
+    /// Encode the leaf into buf, buf.len() must be `LeafNode::<V>::PACKED_SIZE`
+    pub fn pack_into(&self, buf: &mut [u8]) {
+        assert_eq!(buf.len(), Self::PACKED_SIZE, "packed leaf size");
+        buf[..32].copy_from_slice(self.key.as_slice());
+        self.value.pack_value(&mut buf[32..]);
+    }
+
+    /// Decode a leaf from a packed record
+    pub fn unpack(buf: &[u8]) -> Result<Self> {
+        PackedLeafNode::<V>::from_slice(buf).map(|packed| packed.to_leaf_node())
+    }
+}
+
+/// A borrowed packed leaf
+#[derive(Debug, Clone, Copy)]
+pub struct PackedLeafNode<'a, V> {
+    buf: &'a [u8],
+    phantom: PhantomData<V>,
+}
+
+impl<'a, V: PackedValue> PackedLeafNode<'a, V> {
+    /// Wrap a packed record, return CorruptedNode error if size is mismatched
+    pub fn from_slice(buf: &'a [u8]) -> Result<Self> {
+        if buf.len() != LeafNode::<V>::PACKED_SIZE {
+            return Err(Error::CorruptedNode);
+        }
+        Ok(PackedLeafNode {
+            buf,
+            phantom: PhantomData,
+        })
+    }
+
+    pub fn as_slice(&self) -> &'a [u8] {
+        self.buf
+    }
+
+    pub fn key(&self) -> H256 {
+        read_h256(&self.buf[..32])
+    }
+
+    /// The packed value
+    pub fn value_slice(&self) -> &'a [u8] {
+        &self.buf[32..]
+    }
+
+    pub fn value(&self) -> V {
+        V::unpack_value(self.value_slice())
+    }
+
+    pub fn to_leaf_node(&self) -> LeafNode<V> {
+        LeafNode {
+            key: self.key(),
+            value: self.value(),
+        }
+    }
+}
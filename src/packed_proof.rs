@@ -0,0 +1,293 @@
+//! Compact encoding of merkle proofs for the network
+//!
+//! A packed `MerkleProof` is:
+//!
+//! | field        | size                       |
+//! | ------------ | -------------------------- |
+//! | leaves count | varint                     |
+//! | leaves path  | one leaf path per leaf     |
+//! | proof count  | varint                     |
+//! | proof        | 33 bytes per sibling       |
+//!
+//! Varints are unsigned LEB128 in the shortest form.
+//!
+//! A leaf path is the heights of non-zero siblings of the leaf, strictly increasing:
+//!
+//! * `n` in `0..=32`, followed by the `n` heights
+//! * `0xFF`, followed by a 32 bytes bitmap for more than 32 heights,
+//!   height `h` is bit `h % 8` of byte `h / 8`
+//!
+//! A sibling is the height followed by the 32 bytes hash.
+//!
+//! The encoding is canonical, `PackedMerkleProof::from_slice` rejects
+//! any other form. `PackedMerkleProof` reads the proof directly from a
+//! borrowed buffer, it compiles the proof without decoding the leaves path.
+
+use crate::{
+    error::{Error, Result},
+    merkle_proof::{compile_proof, CompiledMerkleProof, LeavesPath, MerkleProof},
+    vec::Vec,
+    H256,
+};
+
+/// Size of a packed sibling
+const PACKED_SIBLING_SIZE: usize = 33;
+/// Max heights of a leaf path in the list form
+const MAX_HEIGHTS_LEN: usize = 32;
+/// Tag of a leaf path in the bitmap form
+const BITMAP_TAG: u8 = 0xFF;
+
+fn write_varint(buf: &mut Vec<u8>, mut n: usize) {
+    while n >= 0x80 {
+        buf.push(n as u8 | 0x80);
+        n >>= 7;
+    }
+    buf.push(n as u8);
+}
+
+/// Read a varint from the head of buf, return the number and its size
+fn read_varint(buf: &[u8]) -> Result<(usize, usize)> {
+    let mut n: usize = 0;
+    for (i, &byte) in buf.iter().enumerate() {
+        let shift = i * 7;
+        let bits = (byte & 0x7F) as usize;
+        if shift >= usize::BITS as usize || (bits << shift) >> shift != bits {
+            return Err(Error::CorruptedProof);
+        }
+        n |= bits << shift;
+        if byte & 0x80 == 0 {
+            // the shortest form never ends with a zero byte
+            if byte == 0 && i > 0 {
+                return Err(Error::CorruptedProof);
+            }
+            return Ok((n, i + 1));
+        }
+    }
+    Err(Error::CorruptedProof)
+}
+
+/// Heights of non-zero siblings of a leaf, borrowed from a packed proof
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PackedLeafPath<'a> {
+    /// At most 32 heights
+    Heights(&'a [u8]),
+    /// A 32 bytes bitmap of more than 32 heights
+    Bitmap(&'a [u8]),
+}
+
+impl<'a> PackedLeafPath<'a> {
+    /// Read a leaf path from the head of buf, return the path and its size
+    fn from_slice(buf: &'a [u8]) -> Result<(Self, usize)> {
+        let tag = *buf.first().ok_or(Error::CorruptedProof)?;
+        if tag == BITMAP_TAG {
+            let bitmap = buf.get(1..33).ok_or(Error::CorruptedProof)?;
+            let len: u32 = bitmap.iter().map(|byte| byte.count_ones()).sum();
+            if len as usize <= MAX_HEIGHTS_LEN {
+                return Err(Error::CorruptedProof);
+            }
+            return Ok((PackedLeafPath::Bitmap(bitmap), 33));
+        }
+        let len = tag as usize;
+        if len > MAX_HEIGHTS_LEN {
+            return Err(Error::CorruptedProof);
+        }
+        let heights = buf.get(1..=len).ok_or(Error::CorruptedProof)?;
+        if heights.windows(2).any(|pair| pair[0] >= pair[1]) {
+            return Err(Error::CorruptedProof);
+        }
+        Ok((PackedLeafPath::Heights(heights), len + 1))
+    }
+
+    /// Number of heights
+    pub fn len(&self) -> usize {
+        match self {
+            PackedLeafPath::Heights(heights) => heights.len(),
+            PackedLeafPath::Bitmap(bitmap) => {
+                bitmap.iter().map(|byte| byte.count_ones() as usize).sum()
+            }
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// The index-th height in increasing order
+    pub fn get(&self, index: usize) -> Option<u8> {
+        match self {
+            PackedLeafPath::Heights(heights) => heights.get(index).copied(),
+            PackedLeafPath::Bitmap(bitmap) => {
+                let mut rest = index as u32;
+                for (i, &byte) in bitmap.iter().enumerate() {
+                    let ones = byte.count_ones();
+                    if rest < ones {
+                        let bit = (0..8u8)
+                            .filter(|bit| byte & (1 << bit) != 0)
+                            .nth(rest as usize)
+                            .expect("set bit");
+                        return Some(i as u8 * 8 + bit);
+                    }
+                    rest -= ones;
+                }
+                None
+            }
+        }
+    }
+
+    /// Iterate heights in increasing order
+    pub fn heights(&self) -> impl Iterator<Item = u8> + 'a {
+        let path = *self;
+        let (heights, bitmap) = match path {
+            PackedLeafPath::Heights(heights) => (heights, &[][..]),
+            PackedLeafPath::Bitmap(bitmap) => (&[][..], bitmap),
+        };
+        let bitmap_heights = (0..=255u8).filter(move |h| {
+            bitmap
+                .get(*h as usize / 8)
+                .map(|byte| byte & (1 << (h % 8)) != 0)
+                .unwrap_or(false)
+        });
+        heights.iter().copied().chain(bitmap_heights)
+    }
+}
+
+impl<'a> LeavesPath for Vec<PackedLeafPath<'a>> {
+    fn leaves_count(&self) -> usize {
+        self.len()
+    }
+    fn height(&self, leaf_index: usize, index: usize) -> Option<u8> {
+        self[leaf_index].get(index)
+    }
+}
+
+/// A borrowed packed merkle proof
+#[derive(Debug, Clone, Copy)]
+pub struct PackedMerkleProof<'a> {
+    buf: &'a [u8],
+    leaves_count: usize,
+    // offset of the first leaf path
+    leaves_offset: usize,
+    proof_count: usize,
+    // offset of the first sibling
+    proof_offset: usize,
+}
+
+impl<'a> PackedMerkleProof<'a> {
+    /// Wrap a packed proof, return CorruptedProof error if the encoding is invalid
+    pub fn from_slice(buf: &'a [u8]) -> Result<Self> {
+        let (leaves_count, mut offset) = read_varint(buf)?;
+        let leaves_offset = offset;
+        // every leaf path takes at least one byte, check before reading
+        if leaves_count > buf.len() - offset {
+            return Err(Error::CorruptedProof);
+        }
+        for _ in 0..leaves_count {
+            let (_path, size) = PackedLeafPath::from_slice(&buf[offset..])?;
+            offset += size;
+        }
+        let (proof_count, size) = read_varint(&buf[offset..])?;
+        let proof_offset = offset + size;
+        let proof_size = proof_count
+            .checked_mul(PACKED_SIBLING_SIZE)
+            .ok_or(Error::CorruptedProof)?;
+        if buf.len() - proof_offset != proof_size {
+            return Err(Error::CorruptedProof);
+        }
+        Ok(PackedMerkleProof {
+            buf,
+            leaves_count,
+            leaves_offset,
+            proof_count,
+            proof_offset,
+        })
+    }
+
+    pub fn as_slice(&self) -> &'a [u8] {
+        self.buf
+    }
+
+    /// number of leaves required by this merkle proof
+    pub fn leaves_count(&self) -> usize {
+        self.leaves_count
+    }
+
+    /// Iterate paths of leaves
+    pub fn leaves_path(&self) -> impl ExactSizeIterator<Item = PackedLeafPath<'a>> + 'a {
+        let buf = self.buf;
+        let mut offset = self.leaves_offset;
+        (0..self.leaves_count).map(move |_| {
+            let (path, size) = PackedLeafPath::from_slice(&buf[offset..]).expect("checked path");
+            offset += size;
+            path
+        })
+    }
+
+    /// Iterate siblings of the proof, `(node, height)` like `MerkleProof::proof`
+    pub fn proof(&self) -> impl ExactSizeIterator<Item = (H256, u8)> + 'a {
+        self.buf[self.proof_offset..]
+            .chunks_exact(PACKED_SIBLING_SIZE)
+            .map(|sibling| {
+                let mut node = [0u8; 32];
+                node.copy_from_slice(&sibling[1..]);
+                (node.into(), sibling[0])
+            })
+    }
+
+    /// number of siblings in the proof
+    pub fn proof_count(&self) -> usize {
+        self.proof_count
+    }
+
+    /// convert the proof into CompiledMerkleProof, see `MerkleProof::compile`
+    pub fn compile(&self, leaves: Vec<(H256, H256)>) -> Result<CompiledMerkleProof> {
+        let leaves_path: Vec<PackedLeafPath> = self.leaves_path().collect();
+        compile_proof(leaves, &leaves_path, self.proof())
+    }
+
+    /// Decode into an owned proof
+    pub fn to_merkle_proof(&self) -> MerkleProof {
+        let leaves_path = self
+            .leaves_path()
+            .map(|path| path.heights().collect())
+            .collect();
+        MerkleProof::new(leaves_path, self.proof().collect())
+    }
+}
+
+impl MerkleProof {
+    /// Encode the proof in the packed format
+    ///
+    /// return CorruptedProof error if heights of a leaf are not strictly increasing
+    pub fn pack(&self) -> Result<Vec<u8>> {
+        let mut buf = Vec::new();
+        write_varint(&mut buf, self.leaves_count());
+        for heights in self.leaves_path() {
+            if heights.windows(2).any(|pair| pair[0] >= pair[1]) {
+                return Err(Error::CorruptedProof);
+            }
+            if heights.len() <= MAX_HEIGHTS_LEN {
+                buf.push(heights.len() as u8);
+                buf.extend_from_slice(heights);
+            } else {
+                let mut bitmap = [0u8; 32];
+                for h in heights {
+                    bitmap[*h as usize / 8] |= 1 << (h % 8);
+                }
+                buf.push(BITMAP_TAG);
+                buf.extend_from_slice(&bitmap);
+            }
+        }
+        write_varint(&mut buf, self.proof().len());
+        buf.reserve(self.proof().len() * PACKED_SIBLING_SIZE);
+        for (node, height) in self.proof() {
+            buf.push(*height);
+            buf.extend_from_slice(node.as_slice());
+        }
+        Ok(buf)
+    }
+
+    /// Decode a proof from the packed format
+    pub fn unpack(buf: &[u8]) -> Result<Self> {
+        PackedMerkleProof::from_slice(buf).map(|packed| packed.to_merkle_proof())
+    }
+}
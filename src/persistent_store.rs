@@ -0,0 +1,183 @@
+use crate::{
+    borrow::Cow,
+    collections::VecDeque,
+    default_store::Map,
+    error::Error,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+
+/// A store which keeps every version of the tree until it is pruned
+///
+/// Nodes are addressed by hash, so the branches of an old root stay valid
+/// as long as they are not removed. This store does not remove nodes
+/// on updates, removed nodes are recorded into the dead set of the current
+/// version instead, every root computed by the tree remains readable.
+///
+/// Call `commit_version` with the new root after updates to seal a version,
+/// and `prune` to delete nodes which are not reachable from the kept roots.
+/// A node inserted again after its removal is alive and never pruned.
+#[derive(Debug, Clone, Default)]
+pub struct PersistentStore<S> {
+    inner: S,
+    // the current version, nodes removed from now on are dead at this version
+    version: u64,
+    current: DeadSet,
+    // sealed versions from old to new: (version, root, nodes removed by the version)
+    versions: VecDeque<(u64, H256, DeadSet)>,
+    // node -> the latest version removing it, resurrected nodes are not in the maps
+    dead_branches: Map<H256, u64>,
+    dead_leaves: Map<H256, u64>,
+}
+
+#[derive(Debug, Clone, Default)]
+struct DeadSet {
+    branches: Vec<H256>,
+    leaves: Vec<H256>,
+}
+
+impl<S> PersistentStore<S> {
+    pub fn new(inner: S) -> Self {
+        PersistentStore {
+            inner,
+            version: 0,
+            current: Default::default(),
+            versions: Default::default(),
+            dead_branches: Default::default(),
+            dead_leaves: Default::default(),
+        }
+    }
+    pub fn inner(&self) -> &S {
+        &self.inner
+    }
+    pub fn inner_mut(&mut self) -> &mut S {
+        &mut self.inner
+    }
+    pub fn into_inner(self) -> S {
+        self.inner
+    }
+    /// Seal nodes removed since the previous version as the dead set of root
+    pub fn commit_version(&mut self, root: H256) {
+        let dead = core::mem::take(&mut self.current);
+        self.versions.push_back((self.version, root, dead));
+        self.version += 1;
+    }
+    /// Sealed roots from old to new
+    pub fn versions(&self) -> impl Iterator<Item = &H256> {
+        self.versions.iter().map(|(_version, root, _dead)| root)
+    }
+    /// Number of removed nodes which are still in the inner store
+    pub fn dead_nodes_count(&self) -> usize {
+        self.dead_branches.len() + self.dead_leaves.len()
+    }
+}
+
+impl<S: Store<V>, V> Store<V> for PersistentStore<S> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.inner.get_branch(node)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        self.inner.get_branch_ref(node)
+    }
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error>
+    where
+        V: Clone,
+    {
+        self.inner.get_leaf_ref(leaf_hash)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        self.inner.get_branches(nodes)
+    }
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<V>>>, Error> {
+        self.inner.get_leaves(leaf_hashes)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.dead_branches.remove(&node);
+        self.inner.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        self.dead_leaves.remove(&leaf_hash);
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.dead_branches.insert(*node, self.version);
+        self.current.branches.push(*node);
+        Ok(())
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.dead_leaves.insert(*leaf_hash, self.version);
+        self.current.leaves.push(*leaf_hash);
+        Ok(())
+    }
+}
+
+impl<S> PersistentStore<S> {
+    /// Delete at most limit dead nodes of sealed versions older than keep_roots,
+    /// return the number of deleted nodes, zero means nothing left to prune
+    ///
+    /// The dead set of a version holds the nodes of the previous version,
+    /// so dead sets up to the oldest kept root are pruned, the latest sealed
+    /// root is always kept. Versions between kept roots are not collected.
+    /// Nothing is pruned if a non-zero root in keep_roots is not a sealed version.
+    ///
+    /// Call it repeatedly with a small limit to delete nodes in batches,
+    /// for example to hold the lock of a `SharedStore` shortly.
+    pub fn prune<V>(&mut self, keep_roots: &[H256], limit: usize) -> Result<usize, Error>
+    where
+        S: Store<V>,
+    {
+        let mut oldest_kept = None;
+        for root in keep_roots.iter().filter(|root| !root.is_zero()) {
+            let version = self
+                .versions
+                .iter()
+                .rev()
+                .find(|(_version, sealed_root, _dead)| sealed_root == root)
+                .map(|(version, _root, _dead)| *version);
+            match version {
+                Some(version) => {
+                    oldest_kept = Some(oldest_kept.map_or(version, |v: u64| v.min(version)));
+                }
+                None => return Ok(0),
+            }
+        }
+
+        let mut count = 0;
+        while count < limit {
+            let (version, dead) = match self.versions.front_mut() {
+                Some((version, _root, dead))
+                    if oldest_kept.map_or(true, |kept| *version <= kept) =>
+                {
+                    (*version, dead)
+                }
+                _ => break,
+            };
+            if let Some(node) = dead.branches.last().copied() {
+                if self.dead_branches.get(&node) == Some(&version) {
+                    self.inner.remove_branch(&node)?;
+                    self.dead_branches.remove(&node);
+                    count += 1;
+                }
+                dead.branches.pop();
+            } else if let Some(leaf_hash) = dead.leaves.last().copied() {
+                if self.dead_leaves.get(&leaf_hash) == Some(&version) {
+                    self.inner.remove_leaf(&leaf_hash)?;
+                    self.dead_leaves.remove(&leaf_hash);
+                    count += 1;
+                }
+                dead.leaves.pop();
+            } else if self.versions.len() > 1 {
+                self.versions.pop_front();
+            } else {
+                // keep the latest root to look up keep_roots
+                break;
+            }
+        }
+        Ok(count)
+    }
+}
@@ -0,0 +1,75 @@
+use crate::{
+    error::Error,
+    string,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+use std::sync::{Arc, RwLock, RwLockReadGuard, RwLockWriteGuard};
+
+/// A store handle which can be cloned and shared between threads
+///
+/// Every read or write of the store holds the lock only for a single call,
+/// so readers are not blocked during a whole update of the tree.
+/// Wrap a `PersistentStore` to read old roots by `Snapshot` while a writer
+/// is updating the tree, nodes of a root are never changed once written.
+#[derive(Debug, Default)]
+pub struct SharedStore<S> {
+    inner: Arc<RwLock<S>>,
+}
+
+impl<S> Clone for SharedStore<S> {
+    fn clone(&self) -> Self {
+        SharedStore {
+            inner: Arc::clone(&self.inner),
+        }
+    }
+}
+
+impl<S> SharedStore<S> {
+    pub fn new(inner: S) -> Self {
+        SharedStore {
+            inner: Arc::new(RwLock::new(inner)),
+        }
+    }
+    /// Lock the store for reading
+    pub fn read(&self) -> Result<RwLockReadGuard<'_, S>, Error> {
+        self.inner.read().map_err(|_| poisoned())
+    }
+    /// Lock the store for writing
+    pub fn write(&self) -> Result<RwLockWriteGuard<'_, S>, Error> {
+        self.inner.write().map_err(|_| poisoned())
+    }
+}
+
+fn poisoned() -> Error {
+    Error::Store(string::String::from("shared store lock is poisoned"))
+}
+
+impl<S: Store<V>, V> Store<V> for SharedStore<S> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.read()?.get_branch(node)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error> {
+        self.read()?.get_leaf(leaf_hash)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        self.read()?.get_branches(nodes)
+    }
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<V>>>, Error> {
+        self.read()?.get_leaves(leaf_hashes)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.write()?.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error> {
+        self.write()?.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.write()?.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.write()?.remove_leaf(leaf_hash)
+    }
+}
@@ -0,0 +1,217 @@
+//! Read-only store on top of an immutable snapshot of a tree
+//!
+//! A snapshot is a byte buffer of packed nodes sorted by hash,
+//! so nodes are found by binary search without loading the snapshot into a map.
+//! Pass a memory mapped file as the buffer to let the OS page cache hold the tree.
+//!
+//! Snapshot layout, integers are little endian:
+//!
+//! | size                          | field                                      |
+//! | ----------------------------- | ------------------------------------------ |
+//! | 8                             | magic `b"SMTSNAP1"`                        |
+//! | 32                            | root                                       |
+//! | 8                             | number of branches                         |
+//! | 8                             | number of leaves                           |
+//! | 8                             | size of packed value                       |
+//! | branches * (32 + 97)          | sorted (node, packed branch) entries       |
+//! | leaves * (32 + 32 + value)    | sorted (leaf hash, packed leaf) entries    |
+//!
+//! Hashes are sorted by their bytes.
+
+use crate::{
+    error::{Error, Result},
+    packed::{PackedValue, PACKED_BRANCH_SIZE},
+    string,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    H256,
+};
+#[cfg(feature = "std")]
+use crate::{
+    traits::{Hasher, Value},
+    tree::NodeType,
+    vec::Vec,
+    SparseMerkleTree,
+};
+use core::marker::PhantomData;
+
+const MAGIC: &[u8; 8] = b"SMTSNAP1";
+const HEADER_SIZE: usize = 64;
+const BRANCH_ENTRY_SIZE: usize = 32 + PACKED_BRANCH_SIZE;
+
+/// A read-only store reading nodes from a snapshot buffer
+#[derive(Debug, Clone)]
+pub struct SnapshotStore<B, V> {
+    buf: B,
+    root: H256,
+    branches_count: usize,
+    leaves_count: usize,
+    phantom: PhantomData<V>,
+}
+
+fn read_u64(buf: &[u8]) -> u64 {
+    let mut data = [0u8; 8];
+    data.copy_from_slice(&buf[..8]);
+    u64::from_le_bytes(data)
+}
+
+/// Binary search sorted (hash, record) entries, return the record
+fn search_entry<'a>(entries: &'a [u8], entry_size: usize, hash: &H256) -> Option<&'a [u8]> {
+    let (mut low, mut high) = (0, entries.len() / entry_size);
+    while low < high {
+        let mid = low + (high - low) / 2;
+        let entry = &entries[mid * entry_size..(mid + 1) * entry_size];
+        match entry[..32].cmp(hash.as_slice()) {
+            core::cmp::Ordering::Less => low = mid + 1,
+            core::cmp::Ordering::Greater => high = mid,
+            core::cmp::Ordering::Equal => return Some(&entry[32..]),
+        }
+    }
+    None
+}
+
+impl<B: AsRef<[u8]>, V: PackedValue> SnapshotStore<B, V> {
+    /// Open a snapshot, return CorruptedSnapshot error if the header mismatches the buffer
+    pub fn new(buf: B) -> Result<Self> {
+        let data = buf.as_ref();
+        if data.len() < HEADER_SIZE || &data[..8] != MAGIC {
+            return Err(Error::CorruptedSnapshot);
+        }
+        let mut root = [0u8; 32];
+        root.copy_from_slice(&data[8..40]);
+        let branches_count = read_u64(&data[40..]) as usize;
+        let leaves_count = read_u64(&data[48..]) as usize;
+        let value_size = read_u64(&data[56..]) as usize;
+        let expected_size = branches_count
+            .checked_mul(BRANCH_ENTRY_SIZE)
+            .and_then(|size| size.checked_add(leaves_count.checked_mul(Self::leaf_entry_size())?))
+            .and_then(|size| size.checked_add(HEADER_SIZE));
+        if value_size != V::PACKED_SIZE || expected_size != Some(data.len()) {
+            return Err(Error::CorruptedSnapshot);
+        }
+        Ok(SnapshotStore {
+            buf,
+            root: root.into(),
+            branches_count,
+            leaves_count,
+            phantom: PhantomData,
+        })
+    }
+
+    fn leaf_entry_size() -> usize {
+        32 + LeafNode::<V>::PACKED_SIZE
+    }
+
+    /// Root of the snapshot tree
+    pub fn root(&self) -> &H256 {
+        &self.root
+    }
+
+    pub fn branches_count(&self) -> usize {
+        self.branches_count
+    }
+
+    pub fn leaves_count(&self) -> usize {
+        self.leaves_count
+    }
+
+    /// Destroy the store and retake the buffer
+    pub fn into_inner(self) -> B {
+        self.buf
+    }
+
+    fn branches(&self) -> &[u8] {
+        &self.buf.as_ref()[HEADER_SIZE..HEADER_SIZE + self.branches_count * BRANCH_ENTRY_SIZE]
+    }
+
+    fn leaves(&self) -> &[u8] {
+        &self.buf.as_ref()[HEADER_SIZE + self.branches_count * BRANCH_ENTRY_SIZE..]
+    }
+}
+
+fn read_only_error() -> Error {
+    Error::Store(string::String::from("snapshot store is read-only"))
+}
+
+impl<B: AsRef<[u8]>, V: PackedValue> Store<V> for SnapshotStore<B, V> {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>> {
+        search_entry(self.branches(), BRANCH_ENTRY_SIZE, node)
+            .map(BranchNode::unpack)
+            .transpose()
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>> {
+        search_entry(self.leaves(), Self::leaf_entry_size(), leaf_hash)
+            .map(LeafNode::unpack)
+            .transpose()
+    }
+    fn insert_branch(&mut self, _node: H256, _branch: BranchNode) -> Result<()> {
+        Err(read_only_error())
+    }
+    fn insert_leaf(&mut self, _leaf_hash: H256, _leaf: LeafNode<V>) -> Result<()> {
+        Err(read_only_error())
+    }
+    fn remove_branch(&mut self, _node: &H256) -> Result<()> {
+        Err(read_only_error())
+    }
+    fn remove_leaf(&mut self, _leaf_hash: &H256) -> Result<()> {
+        Err(read_only_error())
+    }
+}
+
+#[cfg(feature = "std")]
+impl<H: Hasher + Default, V: Value + PackedValue, S: Store<V>> SparseMerkleTree<H, V, S> {
+    /// Write the current tree into a snapshot, which can be opened by `SnapshotStore`
+    ///
+    /// Only nodes reachable from the root are exported.
+    /// Nodes are sorted in memory before written, so the packed tree must fit in memory.
+    pub fn export_snapshot<W: std::io::Write>(&self, writer: &mut W) -> Result<()> {
+        let mut branches: Vec<(H256, [u8; PACKED_BRANCH_SIZE])> = Vec::new();
+        let mut leaves: Vec<(H256, Vec<u8>)> = Vec::new();
+        let mut nodes: Vec<H256> = Vec::new();
+        if !self.is_empty() {
+            nodes.push(*self.root());
+        }
+        while let Some(node) = nodes.pop() {
+            let branch_node = self
+                .store()
+                .get_branch_ref(&node)?
+                .ok_or_else(|| Error::MissingBranch(node))?;
+            match branch_node.node_type {
+                NodeType::Pair(left, right) => {
+                    nodes.push(left);
+                    nodes.push(right);
+                }
+                NodeType::Single(leaf_hash) => {
+                    let leaf = self
+                        .store()
+                        .get_leaf(&leaf_hash)?
+                        .ok_or_else(|| Error::MissingLeaf(leaf_hash))?;
+                    let mut packed = vec![0u8; LeafNode::<V>::PACKED_SIZE];
+                    leaf.pack_into(&mut packed);
+                    leaves.push((leaf_hash, packed));
+                }
+            }
+            branches.push((node, branch_node.pack()));
+        }
+        branches.sort_unstable_by(|(a, _), (b, _)| a.as_slice().cmp(b.as_slice()));
+        leaves.sort_unstable_by(|(a, _), (b, _)| a.as_slice().cmp(b.as_slice()));
+
+        let io_error = |err: std::io::Error| Error::Store(err.to_string());
+        writer.write_all(MAGIC).map_err(io_error)?;
+        writer.write_all(self.root().as_slice()).map_err(io_error)?;
+        for count in &[branches.len(), leaves.len(), V::PACKED_SIZE] {
+            writer
+                .write_all(&(*count as u64).to_le_bytes())
+                .map_err(io_error)?;
+        }
+        for (node, packed) in branches {
+            writer.write_all(node.as_slice()).map_err(io_error)?;
+            writer.write_all(&packed).map_err(io_error)?;
+        }
+        for (leaf_hash, packed) in leaves {
+            writer.write_all(leaf_hash.as_slice()).map_err(io_error)?;
+            writer.write_all(&packed).map_err(io_error)?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,153 @@
+use crate::{
+    async_store::AsyncStore,
+    blake2b::Blake2bHasher,
+    default_store::DefaultStore,
+    error::Error,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    SparseMerkleTree, H256,
+};
+use core::{
+    future::Future,
+    pin::Pin,
+    sync::atomic::{AtomicUsize, Ordering},
+    task::{Context, Poll},
+};
+use rand::{thread_rng, Rng};
+use std::{
+    sync::Arc,
+    task::{Wake, Waker},
+};
+
+type SMT = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>>;
+type RemoteSMT = SparseMerkleTree<Blake2bHasher, H256, RemoteStore>;
+
+struct NoopWaker;
+
+impl Wake for NoopWaker {
+    fn wake(self: Arc<Self>) {}
+}
+
+/// Run future on the current thread, return the output and the number of pending polls
+fn block_on<F: Future>(future: F) -> (F::Output, usize) {
+    let waker = Waker::from(Arc::new(NoopWaker));
+    let mut cx = Context::from_waker(&waker);
+    let mut future = Box::pin(future);
+    let mut round_trips = 0;
+    loop {
+        match future.as_mut().poll(&mut cx) {
+            Poll::Ready(output) => return (output, round_trips),
+            Poll::Pending => round_trips += 1,
+        }
+    }
+}
+
+/// Futures of the tree can be spawned on multi-threaded executors
+fn assert_send<F: Future + Send>(future: F) -> F {
+    future
+}
+
+/// Pending on the first poll, like waiting for a response
+struct RoundTrip(bool);
+
+impl Future for RoundTrip {
+    type Output = ();
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+        if self.0 {
+            Poll::Ready(())
+        } else {
+            self.0 = true;
+            cx.waker().wake_by_ref();
+            Poll::Pending
+        }
+    }
+}
+
+/// A store behind the network, every read takes a round trip
+#[derive(Default)]
+struct RemoteStore {
+    inner: DefaultStore<H256>,
+    reads: AtomicUsize,
+}
+
+impl AsyncStore<H256> for RemoteStore {
+    async fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.reads.fetch_add(1, Ordering::Relaxed);
+        RoundTrip(false).await;
+        self.inner.get_branch(node)
+    }
+    async fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<H256>>, Error> {
+        self.reads.fetch_add(1, Ordering::Relaxed);
+        RoundTrip(false).await;
+        self.inner.get_leaf(leaf_hash)
+    }
+    async fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.inner.insert_branch(node, branch)
+    }
+    async fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<H256>) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    async fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.inner.remove_branch(node)
+    }
+    async fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+fn random_pairs(n: usize) -> Vec<(H256, H256)> {
+    let mut rng = thread_rng();
+    (0..n)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect()
+}
+
+#[test]
+fn test_async_store() {
+    let pairs = random_pairs(200);
+    let (pairs2, removed) = (random_pairs(50), pairs[..50].to_vec());
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut remote = RemoteSMT::default();
+    let (root, round_trips) = block_on(assert_send(remote.async_update_all(pairs.clone())));
+    assert_eq!(root.expect("update all"), smt.root());
+    // the empty tree is not read
+    assert_eq!(round_trips, 0);
+
+    // update and delete leaves
+    let mut batch = pairs2.clone();
+    batch.extend(removed.iter().map(|(k, _v)| (*k, H256::zero())));
+    smt.update_all(batch.clone()).expect("update all");
+    let (root, round_trips) = block_on(remote.async_update_all(batch));
+    assert_eq!(root.expect("update all"), smt.root());
+    assert!(round_trips < 256);
+    assert_eq!(remote.store().inner.leaves_map(), smt.store().leaves_map());
+    assert_eq!(
+        remote.store().inner.branches_map(),
+        smt.store().branches_map()
+    );
+
+    for (k, _v) in pairs.iter().chain(&pairs2) {
+        let (value, round_trips) = block_on(assert_send(remote.async_get(k)));
+        assert_eq!(value, smt.get(k));
+        assert!(round_trips > 0);
+    }
+
+    let keys: Vec<H256> = pairs.iter().chain(&pairs2).map(|(k, _v)| *k).collect();
+    let (values, round_trips) = block_on(assert_send(remote.async_get_many(&keys)));
+    assert_eq!(values, smt.get_many(&keys));
+    assert!(round_trips < 32);
+
+    // one round trip per level instead of per branch
+    let keys: Vec<H256> = pairs[50..].iter().map(|(k, _v)| *k).collect();
+    remote.store().reads.store(0, Ordering::Relaxed);
+    let (proof, round_trips) = block_on(assert_send(remote.async_merkle_proof(keys.clone())));
+    assert_eq!(proof, smt.merkle_proof(keys.clone()));
+    assert!(round_trips * 10 < remote.store().reads.load(Ordering::Relaxed));
+    let (proof, _round_trips) = block_on(remote.async_compiled_merkle_proof(keys.clone()));
+    assert_eq!(
+        proof.expect("compiled proof").0,
+        smt.compiled_merkle_proof(keys).expect("compiled proof").0
+    );
+}
@@ -130,7 +130,16 @@ fn run_test_case(case: Case) -> Result<()> {
             compiled_proof,
             error,
         } = proof;
-        let keys = leaves.iter().map(|(k, _v)| (*k).into()).collect();
+        let keys: Vec<H256> = leaves.iter().map(|(k, _v)| (*k).into()).collect();
+        match smt.compiled_merkle_proof(keys.clone()) {
+            Ok(direct_compiled_proof) => {
+                assert_eq!(error, None, "direct proof");
+                assert_eq!(compiled_proof, direct_compiled_proof.0, "direct proof");
+            }
+            Err(err) => {
+                assert_eq!(error, Some(format!("{}", err)), "direct proof error");
+            }
+        }
         let actual_compiled_proof: Vec<u8> = match smt.merkle_proof(keys) {
             Ok(proof) => proof
                 .compile(
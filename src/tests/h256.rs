@@ -0,0 +1,59 @@
+use crate::H256;
+use core::cmp::Ordering;
+use proptest::prelude::*;
+
+fn bits_fork_height(a: &H256, b: &H256) -> u8 {
+    for h in (0..=core::u8::MAX).rev() {
+        if a.get_bit(h) != b.get_bit(h) {
+            return h;
+        }
+    }
+    0
+}
+
+fn bits_copy_bits(a: &H256, start: u8) -> H256 {
+    let mut target = H256::zero();
+    for h in start..=core::u8::MAX {
+        if a.get_bit(h) {
+            target.set_bit(h);
+        }
+    }
+    target
+}
+
+fn bits_cmp(a: &H256, b: &H256) -> Ordering {
+    for h in (0..=core::u8::MAX).rev() {
+        match a.get_bit(h).cmp(&b.get_bit(h)) {
+            Ordering::Equal => continue,
+            ordering => return ordering,
+        }
+    }
+    Ordering::Equal
+}
+
+proptest! {
+    #[test]
+    fn test_h256_bit_ops(key: [u8; 32], lower: [u8; 32], height: u8) {
+        let a: H256 = key.into();
+        // b has the same bits as a above height
+        let mut b = a.copy_bits(height);
+        let lower: H256 = lower.into();
+        for h in 0..height {
+            if lower.get_bit(h) {
+                b.set_bit(h);
+            }
+        }
+        for (x, y) in &[(a, b), (b, a), (a, a), (a, lower)] {
+            assert_eq!(x.fork_height(y), bits_fork_height(x, y));
+            assert_eq!(x.cmp(y), bits_cmp(x, y));
+        }
+        assert_eq!(a.copy_bits(height), bits_copy_bits(&a, height));
+        assert_eq!(b.copy_bits(height), bits_copy_bits(&b, height));
+        let parent_path = if height == core::u8::MAX {
+            H256::zero()
+        } else {
+            bits_copy_bits(&a, height + 1)
+        };
+        assert_eq!(a.parent_path(height), parent_path);
+    }
+}
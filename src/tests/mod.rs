@@ -1,2 +1,7 @@
+#[cfg(feature = "async")]
+mod async_store;
 mod fixtures;
+mod h256;
+mod packed;
+mod store;
 mod tree;
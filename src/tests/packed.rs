@@ -0,0 +1,182 @@
+use crate::{
+    blake2b::Blake2bHasher,
+    default_store::DefaultStore,
+    error::Error,
+    packed::{PackedBranchNode, PackedLeafNode, PACKED_BRANCH_SIZE},
+    packed_proof::{PackedLeafPath, PackedMerkleProof},
+    tree::{BranchNode, LeafNode, NodeType},
+    MerkleProof, SparseMerkleTree, H256,
+};
+use proptest::prelude::*;
+
+type SMT = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>>;
+
+proptest! {
+    #[test]
+    fn test_pack_branch(fork_height: u8, key: [u8; 32], node: [u8; 32], sibling: [u8; 32]) {
+        let node: H256 = node.into();
+        let mut sibling: H256 = sibling.into();
+        if sibling.is_zero() {
+            sibling.set_bit(0);
+        }
+        for node_type in vec![NodeType::Single(node), NodeType::Pair(node, sibling)] {
+            let branch = BranchNode {
+                fork_height,
+                key: key.into(),
+                node_type,
+            };
+            let packed = branch.pack();
+            assert_eq!(BranchNode::unpack(&packed), Ok(branch.clone()));
+            let packed_branch = PackedBranchNode::from_slice(&packed).expect("packed branch");
+            assert_eq!(packed_branch.fork_height(), branch.fork_height);
+            assert_eq!(packed_branch.key(), branch.key);
+            assert_eq!(packed_branch.node_type(), branch.node_type);
+        }
+    }
+
+    #[test]
+    fn test_pack_leaf(key: [u8; 32], value: [u8; 32]) {
+        let leaf = LeafNode {
+            key: H256::from(key),
+            value: H256::from(value),
+        };
+        let mut packed = [0u8; 64];
+        leaf.pack_into(&mut packed);
+        assert_eq!(LeafNode::unpack(&packed), Ok(leaf.clone()));
+        let packed_leaf = PackedLeafNode::<H256>::from_slice(&packed).expect("packed leaf");
+        assert_eq!(packed_leaf.key(), leaf.key);
+        assert_eq!(packed_leaf.value_slice(), leaf.value.as_slice());
+    }
+
+    #[test]
+    fn test_pack_merkle_proof(
+        pairs in prop::collection::vec((any::<[u8; 32]>(), any::<[u8; 32]>()), 1..50),
+        proven in 1usize..50
+    ) {
+        let mut smt = SMT::default();
+        for (k, v) in &pairs {
+            smt.update((*k).into(), (*v).into()).expect("update");
+        }
+        let mut leaves: Vec<(H256, H256)> = pairs
+            .iter()
+            .take(proven)
+            .map(|(k, _v)| {
+                let k: H256 = (*k).into();
+                (k, smt.get(&k).expect("get"))
+            })
+            .collect();
+        leaves.sort_by_key(|(k, _v)| *k);
+        leaves.dedup_by_key(|(k, _v)| *k);
+        let keys = leaves.iter().map(|(k, _v)| *k).collect();
+        let proof = smt.merkle_proof(keys).expect("proof");
+        let packed = proof.pack().expect("pack");
+        assert_eq!(MerkleProof::unpack(&packed), Ok(proof.clone()));
+
+        let packed_proof = PackedMerkleProof::from_slice(&packed).expect("packed proof");
+        assert_eq!(packed_proof.leaves_count(), proof.leaves_count());
+        assert_eq!(packed_proof.proof_count(), proof.proof().len());
+        for (path, heights) in packed_proof.leaves_path().zip(proof.leaves_path()) {
+            assert_eq!(&path.heights().collect::<Vec<_>>(), heights);
+        }
+        let compiled = packed_proof.compile(leaves.clone()).expect("compile");
+        assert_eq!(compiled.0, proof.clone().compile(leaves.clone()).expect("compile").0);
+        assert!(compiled.verify::<Blake2bHasher>(smt.root(), leaves).expect("verify"));
+        // one byte per height and 33 bytes per sibling, besides the counts
+        let heights_len: usize = proof.leaves_path().iter().map(|path| path.len() + 1).sum();
+        assert!(packed.len() <= heights_len + proof.proof().len() * 33 + 4);
+    }
+}
+
+#[test]
+fn test_pack_tree_branches() {
+    let mut smt = SMT::default();
+    for i in 0u8..100 {
+        smt.update([i; 32].into(), [i + 1; 32].into())
+            .expect("update");
+    }
+    for branch in smt.store().branches_map().values() {
+        assert_eq!(BranchNode::unpack(&branch.pack()).as_ref(), Ok(branch));
+    }
+}
+
+#[test]
+fn test_unpack_corrupted_node() {
+    assert_eq!(
+        BranchNode::unpack(&[0u8; PACKED_BRANCH_SIZE - 1]),
+        Err(Error::CorruptedNode)
+    );
+    assert_eq!(
+        LeafNode::<H256>::unpack(&[0u8; 63]),
+        Err(Error::CorruptedNode)
+    );
+}
+
+#[test]
+fn test_pack_bitmap_leaf_path() {
+    // the zero key has a non-zero sibling on every one of the highest 40 heights
+    let mut smt = SMT::default();
+    smt.update(H256::zero(), [1u8; 32].into()).expect("update");
+    for height in 216..=255u8 {
+        let mut key = H256::zero();
+        key.set_bit(height);
+        smt.update(key, [2u8; 32].into()).expect("update");
+    }
+    let proof = smt.merkle_proof(vec![H256::zero()]).expect("proof");
+    assert_eq!(proof.leaves_path()[0].len(), 40);
+    let packed = proof.pack().expect("pack");
+    assert_eq!(packed[1], 0xFF);
+    assert_eq!(packed.len(), 1 + 33 + 1 + 40 * 33);
+    let packed_proof = PackedMerkleProof::from_slice(&packed).expect("packed proof");
+    let path = packed_proof.leaves_path().next().expect("path");
+    assert!(matches!(path, PackedLeafPath::Bitmap(_)));
+    assert_eq!(path.len(), 40);
+    assert_eq!(path.get(0), Some(216));
+    assert_eq!(path.get(39), Some(255));
+    assert_eq!(path.get(40), None);
+    assert_eq!(MerkleProof::unpack(&packed), Ok(proof.clone()));
+    let leaves = vec![(H256::zero(), [1u8; 32].into())];
+    let compiled = packed_proof.compile(leaves.clone()).expect("compile");
+    assert_eq!(compiled.0, proof.compile(leaves).expect("compile").0);
+}
+
+#[test]
+fn test_unpack_corrupted_proof() {
+    let mut smt = SMT::default();
+    for i in 0u8..20 {
+        smt.update([i; 32].into(), [i + 1; 32].into())
+            .expect("update");
+    }
+    let proof = smt
+        .merkle_proof(vec![[3u8; 32].into(), [7u8; 32].into()])
+        .expect("proof");
+    let packed = proof.pack().expect("pack");
+    for len in 0..packed.len() {
+        assert_eq!(
+            MerkleProof::unpack(&packed[..len]),
+            Err(Error::CorruptedProof)
+        );
+    }
+    let mut trailing = packed.clone();
+    trailing.push(0);
+    assert_eq!(MerkleProof::unpack(&trailing), Err(Error::CorruptedProof));
+    // varints in the shortest form only
+    let mut long_count = vec![0x82, 0x00];
+    long_count.extend_from_slice(&packed[1..]);
+    assert_eq!(MerkleProof::unpack(&long_count), Err(Error::CorruptedProof));
+    // heights must be strictly increasing
+    assert_eq!(
+        MerkleProof::unpack(&[1, 2, 5, 5, 0]),
+        Err(Error::CorruptedProof)
+    );
+    assert_eq!(
+        MerkleProof::new(vec![vec![5, 5]], vec![]).pack(),
+        Err(Error::CorruptedProof)
+    );
+    // a bitmap encodes more than 32 heights only
+    let mut bitmap = vec![1, 0xFF];
+    bitmap.extend_from_slice(&[0x01; 32][..]);
+    bitmap.push(0);
+    assert_eq!(MerkleProof::unpack(&bitmap), Err(Error::CorruptedProof));
+    bitmap[2] = 0x03;
+    assert!(MerkleProof::unpack(&bitmap).is_ok());
+}
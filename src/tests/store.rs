@@ -0,0 +1,774 @@
+use crate::{
+    arena_store::ArenaStore,
+    blake2b::Blake2bHasher,
+    default_store::DefaultStore,
+    deferred_tree::DeferredTree,
+    error::Error,
+    metrics::{take_hash_count, CountingHasher, InstrumentedStore, StoreStats},
+    overlay_store::OverlayStore,
+    persistent_store::PersistentStore,
+    shared_store::SharedStore,
+    traits::Store,
+    tree::{BranchNode, LeafNode, NodeType, Snapshot},
+    SparseMerkleTree, H256,
+};
+use core::cell::Cell;
+use rand::{thread_rng, Rng};
+
+type SMT = SparseMerkleTree<Blake2bHasher, H256, DefaultStore<H256>>;
+type OverlaySMT = SparseMerkleTree<Blake2bHasher, H256, OverlayStore<DefaultStore<H256>, H256>>;
+
+fn random_pairs(n: usize) -> Vec<(H256, H256)> {
+    let mut rng = thread_rng();
+    (0..n)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect()
+}
+
+#[test]
+fn test_overlay_store_commit() {
+    let pairs = random_pairs(100);
+    let mut smt = SMT::default();
+    let mut overlay_smt = OverlaySMT::default();
+    for (k, v) in pairs.iter().cloned() {
+        smt.update(k, v).expect("update");
+        overlay_smt.update(k, v).expect("update");
+    }
+    // delete some leaves in the same block
+    for (k, _v) in pairs.iter().take(30).cloned() {
+        smt.update(k, H256::zero()).expect("update");
+        overlay_smt.update(k, H256::zero()).expect("update");
+    }
+    assert_eq!(smt.root(), overlay_smt.root());
+    assert!(overlay_smt.store().inner().branches_map().is_empty());
+    for (k, _v) in &pairs {
+        assert_eq!(smt.get(k), overlay_smt.get(k));
+    }
+
+    overlay_smt.store_mut().commit().expect("commit");
+    assert!(overlay_smt.store().is_clean());
+    let store = overlay_smt.take_store().into_inner();
+    assert_eq!(store.branches_map(), smt.store().branches_map());
+    assert_eq!(store.leaves_map(), smt.store().leaves_map());
+}
+
+#[test]
+fn test_overlay_store_rollback() {
+    let pairs = random_pairs(50);
+    let mut smt = OverlaySMT::default();
+    for (k, v) in pairs.iter().cloned() {
+        smt.update(k, v).expect("update");
+    }
+    smt.store_mut().commit().expect("commit");
+    let root = *smt.root();
+    let committed = smt.store().inner().clone();
+
+    // speculatively execute a block then drop it
+    for (k, _v) in pairs.iter().take(20).cloned() {
+        smt.update(k, H256::zero()).expect("update");
+    }
+    smt.update_all(random_pairs(20)).expect("update all");
+    assert_ne!(smt.root(), &root);
+    let mut store = smt.take_store();
+    store.rollback();
+    assert_eq!(store.inner().branches_map(), committed.branches_map());
+    assert_eq!(store.inner().leaves_map(), committed.leaves_map());
+
+    let smt = OverlaySMT::new(root, store);
+    for (k, v) in &pairs {
+        assert_eq!(smt.get(k), Ok(*v));
+    }
+}
+
+#[test]
+fn test_overlay_store_coalesce_removes() {
+    type InstrumentedOverlaySMT = SparseMerkleTree<
+        Blake2bHasher,
+        H256,
+        OverlayStore<InstrumentedStore<DefaultStore<H256>>, H256>,
+    >;
+    let pairs = random_pairs(50);
+    let mut smt = SMT::default();
+    let mut overlay_smt = InstrumentedOverlaySMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    overlay_smt.update_all(pairs.clone()).expect("update all");
+    overlay_smt.store_mut().commit().expect("commit");
+
+    // insert then remove new leaves in the same block
+    let new_pairs = random_pairs(20);
+    for (k, v) in &new_pairs {
+        smt.update(*k, *v).expect("update");
+        overlay_smt.update(*k, *v).expect("update");
+    }
+    for (k, _v) in &new_pairs {
+        smt.update(*k, H256::zero()).expect("update");
+        overlay_smt.update(*k, H256::zero()).expect("update");
+    }
+    let inner = overlay_smt.store().inner();
+    inner.take_stats();
+    overlay_smt.store_mut().commit().expect("commit");
+    let inner = overlay_smt.store().inner();
+    let stats = inner.take_stats();
+    assert_eq!(stats.branch_removes, 0);
+    assert_eq!(stats.leaf_removes, 0);
+    assert_eq!(inner.inner().branches_map(), smt.store().branches_map());
+    assert_eq!(inner.inner().leaves_map(), smt.store().leaves_map());
+
+    // a node of the inner store still needs the remove
+    let (k, _v) = pairs[0];
+    smt.update(k, H256::zero()).expect("update");
+    overlay_smt.update(k, H256::zero()).expect("update");
+    overlay_smt.store_mut().commit().expect("commit");
+    let inner = overlay_smt.store().inner();
+    assert_eq!(inner.take_stats().leaf_removes, 1);
+    assert_eq!(inner.inner().leaves_map(), smt.store().leaves_map());
+}
+
+/// Count single and batched branch reads
+#[derive(Default)]
+struct MultiGetStore {
+    inner: DefaultStore<H256>,
+    get_branch_calls: Cell<usize>,
+    get_branches_calls: Cell<usize>,
+}
+
+impl Store<H256> for MultiGetStore {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.get_branch_calls.set(self.get_branch_calls.get() + 1);
+        self.inner.get_branch(node)
+    }
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        self.get_branches_calls
+            .set(self.get_branches_calls.get() + 1);
+        nodes
+            .iter()
+            .map(|node| self.inner.get_branch(node))
+            .collect()
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<H256>>, Error> {
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.inner.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<H256>) -> Result<(), Error> {
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.inner.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+/// Writes fail once the write budget runs out, like a backend losing the connection
+#[derive(Default)]
+struct FailingStore {
+    inner: DefaultStore<H256>,
+    // unlimited writes if None
+    write_budget: Cell<Option<usize>>,
+}
+
+impl FailingStore {
+    fn write(&self) -> Result<(), Error> {
+        match self.write_budget.get() {
+            Some(0) => Err(Error::Store("write failed".to_string())),
+            Some(budget) => {
+                self.write_budget.set(Some(budget - 1));
+                Ok(())
+            }
+            None => Ok(()),
+        }
+    }
+}
+
+impl Store<H256> for FailingStore {
+    fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error> {
+        self.inner.get_branch(node)
+    }
+    fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<H256>>, Error> {
+        self.inner.get_leaf(leaf_hash)
+    }
+    fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error> {
+        self.write()?;
+        self.inner.insert_branch(node, branch)
+    }
+    fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<H256>) -> Result<(), Error> {
+        self.write()?;
+        self.inner.insert_leaf(leaf_hash, leaf)
+    }
+    fn remove_branch(&mut self, node: &H256) -> Result<(), Error> {
+        self.write()?;
+        self.inner.remove_branch(node)
+    }
+    fn remove_leaf(&mut self, leaf_hash: &H256) -> Result<(), Error> {
+        self.write()?;
+        self.inner.remove_leaf(leaf_hash)
+    }
+}
+
+type FailingSMT = SparseMerkleTree<Blake2bHasher, H256, FailingStore>;
+
+#[test]
+fn test_failed_write_keeps_root() {
+    let pairs = random_pairs(100);
+    let mut smt = FailingSMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let root = *smt.root();
+
+    let mut batch = random_pairs(20);
+    batch.extend(pairs[..20].iter().map(|(k, _v)| (*k, H256::zero())));
+    let (new_root, diff) = smt.update_all_diff(batch.clone()).expect("diff");
+    let inserts = diff.leaves.len() + diff.branches.len();
+    assert!(!diff.removed_branches.is_empty());
+    // writes fail while inserting new nodes
+    for budget in (0..inserts).step_by(7) {
+        smt.store().write_budget.set(Some(budget));
+        assert_eq!(
+            smt.update_all(batch.clone()),
+            Err(Error::Store("write failed".to_string()))
+        );
+        assert_eq!(smt.root(), &root);
+        for (k, v) in &pairs {
+            assert_eq!(smt.get(k), Ok(*v));
+        }
+    }
+
+    // retry
+    smt.store().write_budget.set(None);
+    assert_eq!(smt.update_all(batch.clone()), Ok(&new_root));
+    for (k, v) in &batch {
+        assert_eq!(smt.get(k), Ok(*v));
+    }
+}
+
+#[test]
+fn test_deferred_tree_failed_commit() {
+    let pairs = random_pairs(50);
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut tree = FailingSMT::default();
+    tree.update_all(pairs.clone()).expect("update all");
+    let root = *tree.root();
+    let mut deferred = DeferredTree::new(tree);
+
+    let batch = random_pairs(20);
+    for (k, v) in &batch {
+        smt.update(*k, *v).expect("update");
+        deferred.update(*k, *v);
+    }
+    deferred.tree().store().write_budget.set(Some(5));
+    assert_eq!(
+        deferred.commit(),
+        Err(Error::Store("write failed".to_string()))
+    );
+    assert_eq!(deferred.committed_root(), &root);
+    assert_eq!(deferred.pending_count(), batch.len());
+    for (k, v) in pairs.iter().chain(&batch) {
+        assert_eq!(deferred.get(k), Ok(*v));
+    }
+
+    // retry
+    deferred.tree().store().write_budget.set(None);
+    assert_eq!(deferred.commit(), Ok(smt.root()));
+    assert_eq!(deferred.pending_count(), 0);
+}
+
+#[test]
+fn test_level_wise_reads() {
+    let pairs = random_pairs(1000);
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut multi_get_smt =
+        SparseMerkleTree::<Blake2bHasher, H256, _>::new(H256::zero(), MultiGetStore::default());
+    multi_get_smt
+        .update_all(pairs[..500].to_vec())
+        .expect("update all");
+    multi_get_smt
+        .update_all(pairs[500..].to_vec())
+        .expect("update all");
+    assert_eq!(smt.root(), multi_get_smt.root());
+
+    let keys: Vec<_> = pairs.iter().take(100).map(|(k, _v)| *k).collect();
+    multi_get_smt.store().get_branches_calls.set(0);
+    let proof = multi_get_smt.merkle_proof(keys.clone()).expect("proof");
+    assert_eq!(proof, smt.merkle_proof(keys).expect("proof"));
+    assert_eq!(multi_get_smt.store().get_branch_calls.get(), 0);
+    // one call for each level of the tree
+    assert!(multi_get_smt.store().get_branches_calls.get() < 64);
+}
+
+#[test]
+fn test_borrowed_reads() {
+    use crate::borrow::Cow;
+
+    let mut smt = OverlaySMT::default();
+    smt.update_all(random_pairs(10)).expect("update all");
+    let root = *smt.root();
+    // buffered nodes are borrowed from the overlay
+    assert!(matches!(
+        smt.store().get_branch_ref(&root),
+        Ok(Some(Cow::Borrowed(_)))
+    ));
+    smt.store_mut().commit().expect("commit");
+    // committed nodes are borrowed from the inner store
+    assert!(matches!(
+        smt.store().get_branch_ref(&root),
+        Ok(Some(Cow::Borrowed(_)))
+    ));
+    let leaf = smt
+        .store()
+        .inner()
+        .leaves_map()
+        .keys()
+        .next()
+        .cloned()
+        .expect("leaf");
+    assert!(matches!(
+        smt.store().get_leaf_ref(&leaf),
+        Ok(Some(Cow::Borrowed(_)))
+    ));
+}
+
+#[test]
+fn test_snapshot_store() {
+    use crate::snapshot_store::SnapshotStore;
+
+    let pairs = random_pairs(200);
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    // stale nodes are not exported
+    smt.update_all(
+        pairs
+            .iter()
+            .take(50)
+            .map(|(k, _v)| (*k, H256::zero()))
+            .collect(),
+    )
+    .expect("update all");
+
+    let mut snapshot = Vec::new();
+    smt.export_snapshot(&mut snapshot).expect("export");
+    let store = SnapshotStore::<_, H256>::new(&snapshot[..]).expect("open snapshot");
+    assert_eq!(store.root(), smt.root());
+    assert_eq!(store.branches_count(), smt.store().branches_map().len());
+    assert_eq!(store.leaves_count(), smt.store().leaves_map().len());
+
+    let mut snapshot_smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(*store.root(), store);
+    for (k, _v) in &pairs {
+        assert_eq!(snapshot_smt.get(k), smt.get(k));
+    }
+    let keys: Vec<_> = pairs.iter().skip(40).take(20).map(|(k, _v)| *k).collect();
+    assert_eq!(
+        snapshot_smt.merkle_proof(keys.clone()),
+        smt.merkle_proof(keys)
+    );
+    assert!(snapshot_smt.update(pairs[0].0, pairs[0].1).is_err());
+
+    assert_eq!(
+        SnapshotStore::<_, H256>::new(&snapshot[..snapshot.len() - 1]).err(),
+        Some(Error::CorruptedSnapshot)
+    );
+}
+
+#[test]
+fn test_caching_store() {
+    use crate::caching_store::{CachingStore, CACHED_BRANCH_SIZE};
+
+    let pairs = random_pairs(500);
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+
+    let store = CachingStore::new(MultiGetStore::default(), CACHED_BRANCH_SIZE * 64);
+    assert_eq!(store.capacity(), 64);
+    let mut cached_smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(H256::zero(), store);
+    for (k, v) in pairs.iter().take(250) {
+        cached_smt.update(*k, *v).expect("update");
+    }
+    cached_smt
+        .update_all(pairs[250..].to_vec())
+        .expect("update all");
+    assert_eq!(cached_smt.root(), smt.root());
+    assert!(cached_smt.store().cached_branches() <= 64);
+
+    // cached branches are not read from inner store
+    cached_smt.store().reset_counters();
+    cached_smt.store().inner().get_branch_calls.set(0);
+    let keys: Vec<_> = pairs.iter().take(20).map(|(k, _v)| *k).collect();
+    for k in &keys {
+        assert_eq!(cached_smt.get(k), smt.get(k));
+    }
+    let inner_reads = cached_smt.store().inner().get_branch_calls.get();
+    assert!(cached_smt.store().hits() > 0);
+    assert_eq!(cached_smt.store().misses() as usize, inner_reads);
+    assert_eq!(
+        cached_smt.merkle_proof(keys.clone()),
+        smt.merkle_proof(keys)
+    );
+
+    // deleted branches are removed from cache
+    for (k, _v) in pairs.iter().take(400) {
+        cached_smt.update(*k, H256::zero()).expect("update");
+        smt.update(*k, H256::zero()).expect("update");
+    }
+    assert_eq!(cached_smt.root(), smt.root());
+    for (k, _v) in &pairs {
+        assert_eq!(cached_smt.get(k), smt.get(k));
+    }
+
+    // zero budget disables the cache
+    let store = CachingStore::new(DefaultStore::<H256>::default(), 0);
+    let mut cached_smt = SparseMerkleTree::<Blake2bHasher, H256, _>::new(H256::zero(), store);
+    cached_smt.update_all(pairs.clone()).expect("update all");
+    assert_eq!(cached_smt.store().cached_branches(), 0);
+    assert_eq!(cached_smt.store().hits(), 0);
+}
+
+type PersistentSMT =
+    SparseMerkleTree<Blake2bHasher, H256, SharedStore<PersistentStore<DefaultStore<H256>>>>;
+
+#[test]
+fn test_snapshot_concurrent_reads() {
+    fn assert_send_sync<T: Send + Sync>() {}
+    assert_send_sync::<
+        Snapshot<Blake2bHasher, H256, SharedStore<PersistentStore<DefaultStore<H256>>>>,
+    >();
+
+    let pairs = random_pairs(100);
+    let mut smt = PersistentSMT::default();
+    for (k, v) in pairs.iter().cloned() {
+        smt.update(k, v).expect("update");
+    }
+    let snapshot = smt.snapshot();
+    let root = *snapshot.root();
+
+    let readers: Vec<_> = (0..4)
+        .map(|i| {
+            let snapshot = smt.snapshot();
+            let pairs = pairs.clone();
+            std::thread::spawn(move || {
+                for (k, v) in pairs.iter().skip(i).step_by(4) {
+                    assert_eq!(snapshot.get(k), Ok(*v));
+                    let proof = snapshot.merkle_proof(vec![*k]).expect("proof");
+                    assert!(proof
+                        .verify::<Blake2bHasher>(snapshot.root(), vec![(*k, *v)])
+                        .expect("verify"));
+                }
+            })
+        })
+        .collect();
+    // update and delete every key while reading
+    for (k, _v) in pairs.iter().cloned() {
+        smt.update(k, [1u8; 32].into()).expect("update");
+    }
+    for (k, _v) in pairs.iter().take(50).cloned() {
+        smt.update(k, H256::zero()).expect("update");
+    }
+    for reader in readers {
+        reader.join().expect("reader");
+    }
+
+    // old root is still readable
+    assert_eq!(snapshot.root(), &root);
+    for (k, v) in &pairs {
+        assert_eq!(snapshot.get(k), Ok(*v));
+    }
+    let keys: Vec<H256> = pairs.iter().map(|(k, _v)| *k).collect();
+    let proof = snapshot.merkle_proof(keys).expect("proof");
+    assert!(proof
+        .verify::<Blake2bHasher>(&root, pairs.clone())
+        .expect("verify"));
+    for (k, _v) in pairs.iter().take(50) {
+        assert_eq!(smt.get(k), Ok(H256::zero()));
+    }
+}
+
+type VersionedSMT = SparseMerkleTree<Blake2bHasher, H256, PersistentStore<DefaultStore<H256>>>;
+
+#[test]
+fn test_persistent_store_prune() {
+    let pairs = random_pairs(100);
+    let mut smt = SMT::default();
+    let mut versioned_smt = VersionedSMT::default();
+    let mut roots = Vec::new();
+    for (i, chunk) in pairs.chunks(10).enumerate() {
+        let mut leaves = chunk.to_vec();
+        // update previous keys and delete some of them
+        for (k, _v) in pairs.iter().take(i * 10).step_by(3) {
+            let value = if i % 2 == 0 {
+                [i as u8; 32].into()
+            } else {
+                H256::zero()
+            };
+            leaves.push((*k, value));
+        }
+        smt.update_all(leaves.clone()).expect("update");
+        versioned_smt.update_all(leaves).expect("update");
+        let root = *versioned_smt.root();
+        versioned_smt.store_mut().commit_version(root);
+        roots.push((root, versioned_smt.store().inner().clone()));
+    }
+    assert_eq!(smt.root(), versioned_smt.root());
+    assert!(versioned_smt.store().dead_nodes_count() > 0);
+
+    // old roots are readable before prune
+    let (old_root, old_store) = roots[3].clone();
+    let old_smt = SMT::new(old_root, old_store);
+    let old_values: Vec<_> = pairs
+        .iter()
+        .map(|(k, _v)| old_smt.get(k).expect("get"))
+        .collect();
+    let read_old_root = |store: &PersistentStore<DefaultStore<H256>>| {
+        let smt = SMT::new(old_root, store.inner().clone());
+        for ((k, _v), value) in pairs.iter().zip(&old_values) {
+            assert_eq!(smt.get(k).as_ref(), Ok(value));
+        }
+    };
+    read_old_root(versioned_smt.store());
+
+    // unknown roots prune nothing
+    let store = versioned_smt.store_mut();
+    assert_eq!(store.prune(&[[1u8; 32].into()], 100), Ok(0));
+    // prune in batches, keep old root
+    while store.prune(&[old_root, *smt.root()], 7).expect("prune") > 0 {}
+    read_old_root(versioned_smt.store());
+    assert!(versioned_smt.store().dead_nodes_count() > 0);
+
+    // prune all versions except the latest one
+    let store = versioned_smt.store_mut();
+    while store.prune(&[], 7).expect("prune") > 0 {}
+    assert_eq!(versioned_smt.store().dead_nodes_count(), 0);
+    let store = versioned_smt.store().inner();
+    assert_eq!(store.branches_map(), smt.store().branches_map());
+    assert_eq!(store.leaves_map(), smt.store().leaves_map());
+}
+
+#[test]
+fn test_persistent_store_diff() {
+    type InstrumentedSMT = SparseMerkleTree<
+        Blake2bHasher,
+        H256,
+        InstrumentedStore<PersistentStore<DefaultStore<H256>>>,
+    >;
+    let pairs = random_pairs(1000);
+    let mut smt = InstrumentedSMT::default();
+    smt.update_all(pairs.clone()).expect("update");
+    let old_root = *smt.root();
+    let (key, value) = (pairs[42].0, H256::from([42u8; 32]));
+    smt.update(key, value).expect("update");
+    let new_root = *smt.root();
+
+    smt.store().take_stats();
+    let diff: Vec<_> = smt
+        .diff(&old_root, &new_root)
+        .collect::<Result<_, _>>()
+        .expect("diff");
+    assert_eq!(diff, vec![(key, Some(value))]);
+    // only the paths of the changed key are read
+    let stats = smt.store().take_stats();
+    assert!(stats.branch_reads < 64);
+    assert_eq!(stats.leaf_reads, 1);
+
+    // an unknown old root
+    let unknown_root = H256::from([1u8; 32]);
+    assert_eq!(
+        smt.diff(&unknown_root, &new_root).next(),
+        Some(Err(Error::MissingBranch(unknown_root)))
+    );
+}
+
+#[test]
+fn test_persistent_store_resurrect() {
+    let key: H256 = [1u8; 32].into();
+    let other_key: H256 = [2u8; 32].into();
+    let value: H256 = [3u8; 32].into();
+    let mut smt = VersionedSMT::default();
+    smt.update(other_key, value).expect("update");
+    smt.update(key, value).expect("update");
+    let root = *smt.root();
+    smt.store_mut().commit_version(root);
+    // remove nodes then insert them again
+    let removed_root = *smt.update(key, H256::zero()).expect("update");
+    smt.store_mut().commit_version(removed_root);
+    smt.update(key, value).expect("update");
+    assert_eq!(smt.root(), &root);
+    smt.store_mut().commit_version(root);
+
+    while smt.store_mut().prune(&[root], 1).expect("prune") > 0 {}
+    assert_eq!(smt.get(&key), Ok(value));
+    assert_eq!(smt.get(&other_key), Ok(value));
+    let proof = smt.merkle_proof(vec![key]).expect("proof");
+    assert!(proof
+        .verify::<Blake2bHasher>(&root, vec![(key, value)])
+        .expect("verify"));
+}
+
+type ArenaSMT = SparseMerkleTree<Blake2bHasher, H256, ArenaStore<H256>>;
+
+fn assert_same_nodes(arena: &ArenaStore<H256>, store: &DefaultStore<H256>) {
+    assert_eq!(arena.branches_count(), store.branches_map().len());
+    assert_eq!(arena.leaves_count(), store.leaves_map().len());
+    for (node, branch) in store.branches_map() {
+        assert_eq!(arena.get_branch(node).as_ref(), Ok(&Some(branch.clone())));
+    }
+    for (leaf_hash, leaf) in store.leaves_map() {
+        assert_eq!(arena.get_leaf(leaf_hash).as_ref(), Ok(&Some(leaf.clone())));
+    }
+}
+
+#[test]
+fn test_arena_store() {
+    let pairs = random_pairs(200);
+    let mut smt = SMT::default();
+    let mut arena_smt = ArenaSMT::default();
+    for (k, v) in pairs.iter().take(50).cloned() {
+        smt.update(k, v).expect("update");
+        arena_smt.update(k, v).expect("update");
+    }
+    smt.update_all(pairs[50..].to_vec()).expect("update");
+    arena_smt.update_all(pairs[50..].to_vec()).expect("update");
+    assert_eq!(smt.root(), arena_smt.root());
+    assert_same_nodes(arena_smt.store(), smt.store());
+
+    // update, delete and insert back leaves
+    let mut leaves = Vec::new();
+    for (i, (k, v)) in pairs.iter().enumerate() {
+        match i % 3 {
+            0 => leaves.push((*k, H256::zero())),
+            1 => leaves.push((*k, [i as u8; 32].into())),
+            _ => leaves.push((*k, *v)),
+        }
+    }
+    for (k, v) in leaves.iter().take(100).cloned() {
+        smt.update(k, v).expect("update");
+        arena_smt.update(k, v).expect("update");
+    }
+    smt.update_all(leaves[100..].to_vec()).expect("update");
+    arena_smt
+        .update_all(leaves[100..].to_vec())
+        .expect("update");
+    assert_eq!(smt.root(), arena_smt.root());
+    assert_same_nodes(arena_smt.store(), smt.store());
+    for (k, v) in pairs.iter().step_by(3).cloned() {
+        smt.update(k, v).expect("update");
+        arena_smt.update(k, v).expect("update");
+    }
+    assert_eq!(smt.root(), arena_smt.root());
+    assert_same_nodes(arena_smt.store(), smt.store());
+    for (k, _v) in &pairs {
+        assert_eq!(smt.get(k), arena_smt.get(k));
+    }
+}
+
+#[test]
+fn test_arena_store_leaf_branch() {
+    let leaf = LeafNode {
+        key: [1u8; 32].into(),
+        value: H256::from([2u8; 32]),
+    };
+    let leaf_hash: H256 = [3u8; 32].into();
+    let leaf_branch = BranchNode {
+        fork_height: 0,
+        key: leaf.key,
+        node_type: NodeType::Single(leaf_hash),
+    };
+    let mut store = ArenaStore::<H256>::default();
+    store.insert_leaf(leaf_hash, leaf.clone()).expect("insert");
+    store
+        .insert_branch(leaf_hash, leaf_branch.clone())
+        .expect("insert");
+    // the branch is kept after the leaf is removed
+    store.remove_leaf(&leaf_hash).expect("remove");
+    assert_eq!(store.get_leaf(&leaf_hash), Ok(None));
+    assert_eq!(store.get_branch(&leaf_hash), Ok(Some(leaf_branch.clone())));
+    assert_eq!((store.branches_count(), store.leaves_count()), (1, 0));
+    store.insert_leaf(leaf_hash, leaf.clone()).expect("insert");
+    assert_eq!(store.get_leaf(&leaf_hash), Ok(Some(leaf.clone())));
+    // replace the leaf branch with another branch
+    let branch = BranchNode {
+        fork_height: 1,
+        key: leaf.key,
+        node_type: NodeType::Pair(leaf_hash, [4u8; 32].into()),
+    };
+    store
+        .insert_branch(leaf_hash, branch.clone())
+        .expect("insert");
+    assert_eq!(store.get_branch(&leaf_hash), Ok(Some(branch)));
+    store.remove_branch(&leaf_hash).expect("remove");
+    assert_eq!(store.get_branch(&leaf_hash), Ok(None));
+    assert_eq!(store.get_leaf(&leaf_hash), Ok(Some(leaf)));
+    store.remove_leaf(&leaf_hash).expect("remove");
+    assert_eq!((store.branches_count(), store.leaves_count()), (0, 0));
+}
+
+type InstrumentedSMT =
+    SparseMerkleTree<CountingHasher<Blake2bHasher>, H256, InstrumentedStore<DefaultStore<H256>>>;
+
+#[test]
+fn test_instrumented_store() {
+    let key1: H256 = [1u8; 32].into();
+    let key2: H256 = [2u8; 32].into();
+    let value: H256 = [3u8; 32].into();
+    let mut smt = InstrumentedSMT::default();
+    take_hash_count();
+
+    // hash the leaf
+    smt.update(key1, value).expect("update");
+    assert_eq!(take_hash_count(), 1);
+    let stats = smt.store().take_stats();
+    assert_eq!(
+        stats,
+        StoreStats {
+            leaf_inserts: 1,
+            branch_inserts: 1,
+            ..Default::default()
+        }
+    );
+
+    // hash the leaf and merge it with the first leaf
+    smt.update(key2, value).expect("update");
+    assert_eq!(take_hash_count(), 2);
+    let stats = smt.store().take_stats();
+    assert_eq!(stats.branch_reads, 1);
+    assert_eq!((stats.leaf_inserts, stats.branch_inserts), (1, 2));
+    assert_eq!(stats.branch_removes + stats.leaf_removes, 0);
+
+    assert_eq!(smt.get(&key1), Ok(value));
+    let stats = smt.store().take_stats();
+    assert_eq!((stats.branch_reads, stats.leaf_reads), (2, 1));
+
+    smt.merkle_proof(vec![key1, key2]).expect("proof");
+    let stats = smt.store().take_stats();
+    assert_eq!((stats.batch_reads, stats.branch_reads), (2, 3));
+    assert_eq!(take_hash_count(), 0);
+
+    // delete the leaf and its branch
+    smt.update(key1, H256::zero()).expect("update");
+    let stats = smt.store().take_stats();
+    assert_eq!((stats.leaf_removes, stats.branch_removes), (1, 2));
+    assert_eq!(smt.store().stats(), StoreStats::default());
+}
+
+#[test]
+fn test_get_many_reads() {
+    let pairs = random_pairs(1000);
+    let mut smt: SparseMerkleTree<Blake2bHasher, H256, InstrumentedStore<DefaultStore<H256>>> =
+        Default::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut keys: Vec<H256> = pairs.iter().take(100).map(|(k, _v)| *k).collect();
+    keys.extend(random_pairs(10).into_iter().map(|(k, _v)| k));
+    keys.push(keys[0]);
+    smt.store().take_stats();
+
+    let values = smt.get_many(&keys).expect("get many");
+    let stats = smt.store().take_stats();
+    for (key, value) in keys.iter().zip(&values) {
+        assert_eq!(&smt.get(key).expect("get"), value);
+    }
+    let get_stats = smt.store().take_stats();
+    // shared branches are read once, one batch per level and one for leaves
+    assert!(stats.branch_reads * 2 < get_stats.branch_reads);
+    assert_eq!(stats.leaf_reads, 101);
+    assert!(stats.batch_reads < 32);
+}
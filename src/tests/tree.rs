@@ -1,6 +1,6 @@
 use crate::*;
 use crate::{
-    blake2b::Blake2bHasher, default_store::DefaultStore, error::Error, MerkleProof,
+    blake2b::Blake2bHasher, default_store::DefaultStore, error::Error, MerkleProof, RangeProof,
     SparseMerkleTree,
 };
 use proptest::prelude::*;
@@ -44,6 +44,43 @@ fn test_default_tree() {
     assert_ne!(&root2, tree.root());
 }
 
+#[test]
+fn test_compile_duplicated_leaves() {
+    let mut tree = SMT::default();
+    let key: H256 = [42u8; 32].into();
+    tree.update(key, key).expect("update");
+    // duplicated keys are ignored
+    let proof = tree.merkle_proof(vec![key, key]).expect("merkle proof");
+    assert_eq!(proof, tree.merkle_proof(vec![key]).expect("merkle proof"));
+    let proof = MerkleProof::new(vec![Vec::new(), Vec::new()], Vec::new());
+    assert_eq!(
+        proof.compile(vec![(key, key), (key, key)]).err(),
+        Some(Error::UnsortedKeys(key))
+    );
+}
+
+#[test]
+fn test_compiled_proof_stack_overflow() {
+    let leaves: Vec<(H256, H256)> = (0..=MAX_STACK_SIZE as u16)
+        .map(|i| {
+            let mut key = [0u8; 32];
+            key[..2].copy_from_slice(&i.to_le_bytes());
+            (key.into(), [42u8; 32].into())
+        })
+        .collect();
+    let mut sorted_leaves = leaves.clone();
+    sorted_leaves.sort_unstable_by_key(|(k, _v)| *k);
+    let proof = CompiledMerkleProof(vec![0x4C; leaves.len()]);
+    assert_eq!(
+        proof.compute_root::<Blake2bHasher>(leaves),
+        Err(Error::CorruptedStack)
+    );
+    assert_eq!(
+        proof.compute_root_sorted::<Blake2bHasher>(&sorted_leaves),
+        Err(Error::CorruptedStack)
+    );
+}
+
 #[test]
 fn test_default_merkle_proof() {
     let proof = MerkleProof::new(Default::default(), Default::default());
@@ -423,7 +460,18 @@ proptest! {
         let data: Vec<(H256, H256)> = pairs.into_iter().take(n).collect();
         let compiled_proof = proof.clone().compile(data.clone()).expect("compile proof");
         assert!(proof.verify::<Blake2bHasher>(smt.root(), data.clone()).expect("verify proof"));
-        assert!(compiled_proof.verify::<Blake2bHasher>(smt.root(), data).expect("verify compiled proof"));
+        assert!(compiled_proof.verify::<Blake2bHasher>(smt.root(), data.clone()).expect("verify compiled proof"));
+
+        let mut sorted_data = data;
+        sorted_data.sort_unstable_by_key(|(k, _v)| *k);
+        assert!(compiled_proof.verify_sorted::<Blake2bHasher>(smt.root(), &sorted_data).expect("verify sorted"));
+        if sorted_data.len() > 1 {
+            sorted_data.swap(0, 1);
+            assert_eq!(
+                compiled_proof.verify_sorted::<Blake2bHasher>(smt.root(), &sorted_data),
+                Err(Error::UnsortedKeys(sorted_data[1].0))
+            );
+        }
     }
 
     #[test]
@@ -522,6 +570,326 @@ proptest! {
         }
     }
 
+    #[test]
+    fn test_smt_update_all((pairs, n) in leaves(1, 50), (pairs2, _n2) in leaves(1, 20)){
+        let mut smt = new_smt(pairs.clone());
+        let mut smt2 = SMT::default();
+        smt2.update_all(pairs.clone()).expect("update all");
+        assert_eq!(smt.root(), smt2.root());
+
+        // delete some leaves, insert new leaves and duplicated keys
+        let mut updates: Vec<_> = pairs.into_iter().take(n).map(|(k, _v)| (k, H256::zero())).collect();
+        updates.extend(pairs2.iter().cloned());
+        updates.extend(pairs2.into_iter().map(|(k, _v)| (k, [42u8; 32].into())));
+        for (k, v) in updates.clone() {
+            smt.update(k, v).expect("update");
+        }
+        smt2.update_all(updates.clone()).expect("update all");
+        assert_eq!(smt.root(), smt2.root());
+        for (k, _v) in updates {
+            assert_eq!(smt.get(&k), smt2.get(&k));
+        }
+        let mut branches: Vec<_> = smt.store().branches_map().keys().collect();
+        let mut branches2: Vec<_> = smt2.store().branches_map().keys().collect();
+        branches.sort_unstable();
+        branches2.sort_unstable();
+        assert_eq!(branches, branches2);
+        assert_eq!(smt.store().leaves_map(), smt2.store().leaves_map());
+    }
+
+    #[test]
+    fn test_smt_from_sorted_iter((pairs, n) in leaves(0, 50)){
+        let mut smt = SMT::default();
+        smt.update_all(pairs.clone()).expect("update all");
+
+        // zero values are skipped
+        let mut sorted = pairs.clone();
+        for (_k, v) in sorted.iter_mut().take(n) {
+            *v = H256::zero();
+        }
+        sorted.sort_unstable_by_key(|(k, _v)| *k);
+        let smt2 = SMT::from_sorted_iter(Default::default(), sorted.clone()).expect("build");
+        let mut smt3 = SMT::default();
+        smt3.update_all(sorted.clone()).expect("update all");
+        assert_eq!(smt2.root(), smt3.root());
+        assert_eq!(smt2.store().branches_map(), smt3.store().branches_map());
+        assert_eq!(smt2.store().leaves_map(), smt3.store().leaves_map());
+        if n == 0 {
+            assert_eq!(smt.root(), smt2.root());
+        }
+
+        if sorted.len() > 1 {
+            sorted.swap(0, 1);
+            assert_eq!(
+                SMT::from_sorted_iter(Default::default(), sorted.clone()).err(),
+                Some(Error::UnsortedKeys(sorted[1].0))
+            );
+        }
+    }
+
+    #[test]
+    fn test_deferred_tree((pairs, n) in leaves(1, 50)){
+        let mut smt = new_smt(pairs.clone());
+        let mut deferred = DeferredTree::new(new_smt(pairs.clone()));
+        // overwrite, delete and insert back keys in the same batch
+        for (i, (k, v)) in pairs.iter().take(n).enumerate() {
+            let new_value: H256 = [i as u8 + 1; 32].into();
+            for value in vec![new_value, H256::zero(), *v, new_value] {
+                smt.update(*k, value).expect("update");
+                deferred.update(*k, value);
+            }
+            if i % 2 == 0 {
+                smt.update(*k, H256::zero()).expect("update");
+                deferred.update(*k, H256::zero());
+            }
+            assert_eq!(deferred.get(k), smt.get(k));
+        }
+        assert_eq!(deferred.pending_count(), n);
+        assert_ne!(deferred.committed_root(), smt.root());
+        assert_eq!(deferred.commit().expect("commit"), smt.root());
+        assert_eq!(deferred.pending_count(), 0);
+        let tree = deferred.into_tree();
+        assert_eq!(tree.store().leaves_map(), smt.store().leaves_map());
+        for (k, _v) in &pairs {
+            assert_eq!(tree.get(k), smt.get(k));
+        }
+    }
+
+    #[test]
+    fn test_update_diff((pairs, n) in leaves(1, 50), (pairs2, _n2) in leaves(1, 10)){
+        let mut smt = new_smt(pairs.clone());
+        let mut expected = new_smt(pairs.clone());
+        // rewriting the current value writes nothing
+        for (k, v) in pairs.iter().take(n) {
+            let (root, diff) = smt.update_diff(*k, *v).expect("update diff");
+            assert_eq!(&root, smt.root());
+            assert!(diff.is_empty());
+            let (root, diff) = smt.update_all_diff(vec![(*k, *v)]).expect("update all diff");
+            assert_eq!(&root, smt.root());
+            assert!(diff.is_empty());
+        }
+        let updates = pairs2.into_iter().chain(pairs.iter().take(n).map(|(k, _v)| (*k, H256::zero())));
+        for (k, v) in updates {
+            let (root, diff) = smt.update_diff(k, v).expect("update diff");
+            for (node, _branch) in &diff.branches {
+                assert!(!diff.removed_branches.contains(node));
+            }
+            for (leaf_hash, _leaf) in &diff.leaves {
+                assert!(!diff.removed_leaves.contains(leaf_hash));
+            }
+            let mut store = smt.take_store();
+            diff.apply(&mut store).expect("apply");
+            smt = SMT::new(root, store);
+            assert_eq!(expected.update(k, v).expect("update"), smt.root());
+            assert_eq!(smt.get(&k), expected.get(&k));
+        }
+        assert_eq!(smt.store().leaves_map(), expected.store().leaves_map());
+        for (k, _v) in &pairs {
+            assert_eq!(smt.get(k), expected.get(k));
+        }
+    }
+
+    #[test]
+    fn test_diff((pairs, n) in leaves(0, 50), (pairs2, _n2) in leaves(0, 10)){
+        use crate::{persistent_store::PersistentStore, default_store::Map};
+
+        type VersionedSMT = SparseMerkleTree<Blake2bHasher, H256, PersistentStore<DefaultStore<H256>>>;
+        let mut smt = VersionedSMT::default();
+        for (k, v) in &pairs {
+            smt.update(*k, *v).expect("update");
+        }
+        let old_root = *smt.root();
+        // delete, update, rewrite and insert keys, the batch update changes the layout of branches
+        let mut leaves = pairs2.clone();
+        for (i, (k, v)) in pairs.iter().take(n).enumerate() {
+            let value = match i % 3 {
+                0 => H256::zero(),
+                1 => [i as u8 + 1; 32].into(),
+                _ => *v,
+            };
+            leaves.push((*k, value));
+        }
+        smt.update_all(leaves.clone()).expect("update all");
+        let new_root = *smt.root();
+
+        let old_values: Map<H256, H256> = pairs.iter().cloned().collect();
+        let mut new_values = old_values.clone();
+        for (k, v) in &leaves {
+            new_values.insert(*k, *v);
+        }
+        let mut keys: Vec<H256> = new_values.keys().cloned().collect();
+        keys.sort();
+        let value_of = |values: &Map<H256, H256>, k: &H256| {
+            Some(values.get(k).cloned().unwrap_or_default()).filter(|v| !v.is_zero())
+        };
+        let changes = |from: &Map<H256, H256>, to: &Map<H256, H256>| -> Vec<(H256, Option<H256>)> {
+            keys.iter()
+                .filter(|k| value_of(from, k) != value_of(to, k))
+                .map(|k| (*k, value_of(to, k)))
+                .collect()
+        };
+        let diff: Vec<_> = smt.diff(&old_root, &new_root).collect::<Result<_, _>>().expect("diff");
+        assert_eq!(diff, changes(&old_values, &new_values));
+        let diff: Vec<_> = smt.diff(&new_root, &old_root).collect::<Result<_, _>>().expect("diff");
+        assert_eq!(diff, changes(&new_values, &old_values));
+        assert_eq!(smt.diff(&new_root, &new_root).count(), 0);
+        let all: Vec<_> = smt.diff(&H256::zero(), &new_root).collect::<Result<_, _>>().expect("diff");
+        let leaves: Vec<_> = smt.iter_range(..).map(|leaf| leaf.map(|leaf| (leaf.key, Some(leaf.value)))).collect::<Result<_, _>>().expect("iter");
+        assert_eq!(all, leaves);
+    }
+
+    #[test]
+    fn test_iter_range((pairs, n) in leaves(0, 50), start in any::<[u8; 32]>(), len in 0u16..=12){
+        use core::ops::Bound;
+        use std::collections::BTreeMap;
+
+        let smt = new_smt(pairs.clone());
+        let mut expected = BTreeMap::new();
+        for (k, v) in &pairs {
+            expected.insert(*k, *v);
+        }
+        expected.retain(|_k, v| !v.is_zero());
+        let collect = |iter: iter::LeafIter<'_, H256, DefaultStore<H256>>| {
+            iter.map(|leaf| leaf.map(|leaf| (leaf.key, leaf.value)))
+                .collect::<Result<Vec<_>, _>>()
+                .expect("iter")
+        };
+        let collect_expected = |range: (Bound<H256>, Bound<H256>)| {
+            expected.range(range).map(|(k, v)| (*k, *v)).collect::<Vec<_>>()
+        };
+
+        assert_eq!(collect(smt.iter_range(..)), collect_expected((Bound::Unbounded, Bound::Unbounded)));
+        let start: H256 = start.into();
+        let end = pairs.get(n).map(|(k, _v)| *k).unwrap_or_default();
+        let (start, end) = if start <= end { (start, end) } else { (end, start) };
+        assert_eq!(collect(smt.iter_range(start..end)), collect_expected((Bound::Included(start), Bound::Excluded(end))));
+        assert_eq!(collect(smt.iter_range(start..=end)), collect_expected((Bound::Included(start), Bound::Included(end))));
+        assert_eq!(collect(smt.iter_range(start..)), collect_expected((Bound::Included(start), Bound::Unbounded)));
+        assert_eq!(collect(smt.iter_range(..=end)), collect_expected((Bound::Unbounded, Bound::Included(end))));
+
+        // keys with the same highest len bits as end
+        let prefixed: Vec<_> = expected
+            .iter()
+            .filter(|(k, _v)| len == 0 || u16::from(k.fork_height(&end)) < 256 - len)
+            .map(|(k, v)| (*k, *v))
+            .collect();
+        assert_eq!(collect(smt.iter_prefix(&end, len)), prefixed);
+        assert_eq!(collect(smt.iter_prefix(&end, 256)), collect_expected((Bound::Included(end), Bound::Included(end))));
+    }
+
+    #[test]
+    fn test_range_proof((pairs, n) in leaves(1, 50), start in any::<[u8; 32]>()){
+        let smt = new_smt(pairs.clone());
+        let start: H256 = start.into();
+        let end = pairs[n % pairs.len()].0;
+        let (start, end) = if start <= end { (start, end) } else { (end, start) };
+        let (leaves, proof) = match smt.range_proof(start..=end) {
+            Ok(result) => result,
+            Err(err) => {
+                assert_eq!(err, Error::EmptyKeys);
+                assert_eq!(smt.iter_range(start..=end).count(), 0);
+                return;
+            }
+        };
+        let leaves: Vec<(H256, H256)> = leaves.into_iter().map(|leaf| (leaf.key, leaf.value)).collect();
+        let keys: Vec<H256> = leaves.iter().map(|(k, _v)| *k).collect();
+        // the same program as the compiled proof of the leaves
+        let compiled_proof = smt.compiled_merkle_proof(keys.clone()).expect("compiled proof");
+        assert_eq!(proof.compile(&leaves).expect("compile").0, compiled_proof.0);
+        assert!(proof.verify::<Blake2bHasher>(smt.root(), leaves.clone()).expect("verify"));
+
+        let mut tampered = leaves.clone();
+        tampered[0].1 = [42u8; 32].into();
+        assert_ne!(proof.verify::<Blake2bHasher>(smt.root(), tampered), Ok(true));
+        if leaves.len() > 2 {
+            let mut missing = leaves.clone();
+            missing.remove(1);
+            assert_ne!(proof.verify::<Blake2bHasher>(smt.root(), missing), Ok(true));
+        }
+        if !proof.right().is_empty() {
+            let (left, mut right) = proof.take();
+            right.reverse();
+            right.push(right[0]);
+            let proof = RangeProof::new(left, right);
+            assert_eq!(proof.verify::<Blake2bHasher>(smt.root(), leaves), Err(Error::CorruptedProof));
+        }
+    }
+
+    #[test]
+    fn test_get_many((pairs, n) in leaves(0, 50), (pairs2, _n2) in leaves(0, 10)){
+        let smt = new_smt(pairs.clone());
+        let mut keys: Vec<H256> = pairs.iter().chain(&pairs2).map(|(k, _v)| *k).collect();
+        keys.shuffle(&mut rand::thread_rng());
+        keys.extend(pairs.iter().take(n).map(|(k, _v)| *k));
+        let values: Vec<H256> = keys.iter().map(|k| smt.get(k).expect("get")).collect();
+        assert_eq!(smt.get_many(&keys).expect("get many"), values);
+    }
+
+    #[test]
+    fn test_hash_pair(pairs in prop::collection::vec((any::<[u8; 32]>(), any::<[u8; 32]>()), 0..10)){
+        use crate::traits::Hasher;
+
+        let pairs: Vec<(H256, H256)> = pairs.into_iter().map(|(l, r)| (l.into(), r.into())).collect();
+        let mut hashes = vec![H256::zero(); pairs.len()];
+        Blake2bHasher::hash_pairs(&pairs, &mut hashes);
+        for ((lhs, rhs), hash) in pairs.iter().zip(hashes) {
+            let mut hasher = Blake2bHasher::default();
+            hasher.write_h256(lhs);
+            hasher.write_h256(rhs);
+            let expected = hasher.finish();
+            assert_eq!(Blake2bHasher::hash_pair(lhs, rhs), expected);
+            assert_eq!(hash, expected);
+        }
+    }
+
+    #[test]
+    fn test_smt_compiled_merkle_proof((pairs, n) in leaves(0, 50), (pairs2, n2) in leaves(1, 5)){
+        let smt = new_smt(pairs.clone());
+        // include non-exists keys
+        let mut leaves: Vec<_> = pairs.into_iter().take(n).collect();
+        leaves.extend(pairs2.into_iter().take(n2).map(|(k, _v)| (k, H256::zero())));
+        let keys: Vec<_> = leaves.iter().map(|(k, _v)| *k).collect();
+        if leaves.is_empty() {
+            assert_eq!(smt.compiled_merkle_proof(keys).err(), Some(Error::EmptyKeys));
+        } else {
+            let proof = smt.merkle_proof(keys.clone()).expect("gen proof");
+            let compiled_proof = proof.compile(leaves).expect("compile proof");
+            let direct_compiled_proof = smt.compiled_merkle_proof(keys).expect("gen compiled proof");
+            assert_eq!(direct_compiled_proof.0, compiled_proof.0);
+        }
+    }
+
+    #[test]
+    fn test_verify_compiled_proofs((pairs, _n) in leaves(1, 50), proofs_count in 1usize..10){
+        use crate::merkle_proof::verify_compiled_proofs;
+
+        let smt = new_smt(pairs.clone());
+        let mut proofs: Vec<(Vec<u8>, Vec<(H256, H256)>)> = Vec::new();
+        for i in 0..proofs_count {
+            let mut leaves: Vec<_> = pairs.iter().skip(i % pairs.len()).step_by(i + 1).cloned().collect();
+            leaves.sort_unstable_by_key(|(k, _v)| *k);
+            let keys = leaves.iter().map(|(k, _v)| *k).collect();
+            let proof = smt.compiled_merkle_proof(keys).expect("gen proof");
+            match i % 4 {
+                // invalid leaf
+                1 => leaves[0].1 = [42u8; 32].into(),
+                // corrupted program
+                2 => proofs.push((vec![0x4C, 0x48, 0], leaves.clone())),
+                // unsorted leaves
+                3 => leaves.reverse(),
+                _ => {},
+            }
+            proofs.push((proof.0, leaves));
+        }
+        let batch: Vec<(&[u8], &[(H256, H256)])> = proofs.iter().map(|(p, l)| (&p[..], &l[..])).collect();
+        let results = verify_compiled_proofs::<Blake2bHasher>(smt.root(), &batch);
+        assert_eq!(results.len(), proofs.len());
+        for ((program, leaves), result) in proofs.into_iter().zip(results) {
+            let expected = CompiledMerkleProof(program).verify_sorted::<Blake2bHasher>(smt.root(), &leaves);
+            assert_eq!(result, expected);
+        }
+    }
+
     #[test]
     fn test_smt_not_crash(
         (leaves, _n) in leaves(0, 30),
@@ -717,6 +1085,99 @@ fn test_replay_to_pass_proof() {
     );
 }
 
+#[test]
+fn test_range_proof_hidden_leaf() {
+    fn key_with_bits(bits: &[u8]) -> H256 {
+        let mut key = H256::zero();
+        for bit in bits {
+            key.set_bit(*bit);
+        }
+        key
+    }
+    let value: H256 = [1u8; 32].into();
+    // the middle leaf is hidden as a sibling of the first leaf, then of the last leaf
+    let cases: [([&[u8]; 3], bool); 2] =
+        [([&[], &[3], &[10]], true), ([&[], &[10], &[3, 10]], false)];
+    for (bits, hidden_in_left) in cases.iter().copied() {
+        let keys: Vec<H256> = bits.iter().map(|bits| key_with_bits(bits)).collect();
+        let mut smt = SMT::default();
+        for key in &keys {
+            smt.update(*key, value).expect("update");
+        }
+        let leaves: Vec<(H256, H256)> = keys.iter().map(|key| (*key, value)).collect();
+        let (_leaves, proof) = smt.range_proof(..).expect("range proof");
+        assert!(proof
+            .verify::<Blake2bHasher>(smt.root(), leaves.clone())
+            .expect("verify"));
+
+        let neighbour = if hidden_in_left { keys[0] } else { keys[2] };
+        let sibling = vec![(
+            keys[1].fork_height(&neighbour),
+            merge::hash_leaf::<Blake2bHasher>(&keys[1], &value),
+        )];
+        let proof = if hidden_in_left {
+            RangeProof::new(sibling, Vec::new())
+        } else {
+            RangeProof::new(Vec::new(), sibling)
+        };
+        let hole = vec![leaves[0], leaves[2]];
+        assert_eq!(
+            proof.verify::<Blake2bHasher>(smt.root(), hole),
+            Err(Error::CorruptedProof)
+        );
+    }
+}
+
+#[test]
+fn test_iter_range_reads() {
+    use crate::metrics::InstrumentedStore;
+
+    let leaves: Vec<(H256, H256)> = (0..256u16)
+        .map(|i| {
+            let mut key = [0u8; 32];
+            key[31] = i as u8;
+            (key.into(), [1u8; 32].into())
+        })
+        .collect();
+    let smt: SparseMerkleTree<Blake2bHasher, H256, _> = SparseMerkleTree::from_sorted_iter(
+        InstrumentedStore::new(DefaultStore::default()),
+        leaves.clone(),
+    )
+    .expect("build");
+    smt.store().take_stats();
+
+    // a full walk reads every branch once
+    assert_eq!(smt.iter_range(..).count(), 256);
+    let stats = smt.store().take_stats();
+    assert_eq!(stats.branch_reads, 511);
+    assert_eq!((stats.leaf_reads, stats.batch_reads), (256, 255));
+
+    // only paths of the leaves in range are read
+    let range: Vec<_> = smt
+        .iter_range(leaves[16].0..leaves[20].0)
+        .map(|leaf| leaf.expect("leaf").key)
+        .collect();
+    let keys: Vec<_> = leaves[16..20].iter().map(|(k, _v)| *k).collect();
+    assert_eq!(range, keys);
+    let stats = smt.store().take_stats();
+    assert_eq!(stats.leaf_reads, 4);
+    assert!(stats.branch_reads < 32);
+
+    let prefix: Vec<_> = smt
+        .iter_prefix(&leaves[0xA5].0, 4)
+        .map(|leaf| leaf.expect("leaf").key)
+        .collect();
+    let keys: Vec<_> = leaves[0xA0..0xB0].iter().map(|(k, _v)| *k).collect();
+    assert_eq!(prefix, keys);
+
+    // iteration stops after an error
+    let root = *smt.root();
+    let smt = SMT::new(root, DefaultStore::default());
+    let mut iter = smt.iter_range(..);
+    assert_eq!(iter.next(), Some(Err(Error::MissingBranch(root))));
+    assert_eq!(iter.next(), None);
+}
+
 #[test]
 fn test_max_stack_size() {
     fn gen_h256(height: u8) -> H256 {
@@ -752,3 +1213,59 @@ fn test_max_stack_size() {
         .verify::<Blake2bHasher>(smt.root(), pairs)
         .expect("verify"));
 }
+
+#[cfg(feature = "rayon")]
+#[test]
+fn test_par_update_all() {
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..5000)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut smt2 = SMT::default();
+    smt2.par_update_all(pairs.clone())
+        .expect("parallel update all");
+    assert_eq!(smt.root(), smt2.root());
+
+    // delete half of the leaves
+    let updates: Vec<_> = pairs
+        .into_iter()
+        .step_by(2)
+        .map(|(k, _v)| (k, H256::zero()))
+        .collect();
+    smt.update_all(updates.clone()).expect("update all");
+    smt2.par_update_all(updates).expect("parallel update all");
+    assert_eq!(smt.root(), smt2.root());
+    assert_eq!(smt.store().leaves_map(), smt2.store().leaves_map());
+}
+
+#[cfg(feature = "rayon")]
+#[test]
+fn test_par_verify_compiled_proofs() {
+    use crate::merkle_proof::{par_verify_compiled_proofs, verify_compiled_proofs};
+
+    let mut rng = rand::thread_rng();
+    let pairs: Vec<(H256, H256)> = (0..300)
+        .map(|_| (rng.gen::<[u8; 32]>().into(), rng.gen::<[u8; 32]>().into()))
+        .collect();
+    let mut smt = SMT::default();
+    smt.update_all(pairs.clone()).expect("update all");
+    let mut proofs: Vec<(Vec<u8>, Vec<(H256, H256)>)> = pairs
+        .iter()
+        .map(|(k, v)| {
+            let proof = smt.compiled_merkle_proof(vec![*k]).expect("gen proof");
+            (proof.0, vec![(*k, *v)])
+        })
+        .collect();
+    proofs[42].1[0].1 = H256::zero();
+    let batch: Vec<(&[u8], &[(H256, H256)])> =
+        proofs.iter().map(|(p, l)| (&p[..], &l[..])).collect();
+    let results = par_verify_compiled_proofs::<Blake2bHasher>(smt.root(), &batch);
+    assert_eq!(
+        results,
+        verify_compiled_proofs::<Blake2bHasher>(smt.root(), &batch)
+    );
+    assert_eq!(results[42], Err(Error::ForbidZeroValueLeaf));
+    assert_eq!(results.iter().filter(|r| r == &&Ok(true)).count(), 299);
+}
@@ -1,6 +1,8 @@
 use crate::{
+    borrow::Cow,
     error::Error,
     tree::{BranchNode, LeafNode},
+    vec::Vec,
     H256,
 };
 
@@ -8,6 +10,31 @@ use crate::{
 pub trait Hasher {
     fn write_h256(&mut self, h: &H256);
     fn finish(self) -> H256;
+
+    /// Hash two H256 in one shot, hashers can override it to skip the
+    /// per-hash initialization
+    fn hash_pair(lhs: &H256, rhs: &H256) -> H256
+    where
+        Self: Default + Sized,
+    {
+        let mut hasher = Self::default();
+        hasher.write_h256(lhs);
+        hasher.write_h256(rhs);
+        hasher.finish()
+    }
+
+    /// Hash independent pairs into outputs, outputs must be as long as pairs
+    ///
+    /// Hashers can override it to hash multiple lanes at once.
+    fn hash_pairs(pairs: &[(H256, H256)], outputs: &mut [H256])
+    where
+        Self: Default + Sized,
+    {
+        assert_eq!(pairs.len(), outputs.len());
+        for ((lhs, rhs), output) in pairs.iter().zip(outputs.iter_mut()) {
+            *output = Self::hash_pair(lhs, rhs);
+        }
+    }
 }
 
 /// Trait for define value structures
@@ -29,6 +56,32 @@ impl Value for H256 {
 pub trait Store<V> {
     fn get_branch(&self, node: &H256) -> Result<Option<BranchNode>, Error>;
     fn get_leaf(&self, leaf_hash: &H256) -> Result<Option<LeafNode<V>>, Error>;
+    /// Borrow a branch without cloning it, traversals of the tree read branches by this method.
+    /// The default implementation returns an owned branch from `get_branch`,
+    /// stores holding nodes in memory should override it.
+    fn get_branch_ref(&self, node: &H256) -> Result<Option<Cow<'_, BranchNode>>, Error> {
+        Ok(self.get_branch(node)?.map(Cow::Owned))
+    }
+    /// Borrow a leaf without cloning it, see `get_branch_ref`
+    fn get_leaf_ref(&self, leaf_hash: &H256) -> Result<Option<Cow<'_, LeafNode<V>>>, Error>
+    where
+        V: Clone,
+    {
+        Ok(self.get_leaf(leaf_hash)?.map(Cow::Owned))
+    }
+    /// Get multiple branches in one call, the tree reads one level of nodes at a time.
+    /// The default implementation calls `get_branch` for each node,
+    /// backends supporting batched reads should override it.
+    fn get_branches(&self, nodes: &[H256]) -> Result<Vec<Option<BranchNode>>, Error> {
+        nodes.iter().map(|node| self.get_branch(node)).collect()
+    }
+    /// Get multiple leaves in one call, see `get_branches`
+    fn get_leaves(&self, leaf_hashes: &[H256]) -> Result<Vec<Option<LeafNode<V>>>, Error> {
+        leaf_hashes
+            .iter()
+            .map(|leaf_hash| self.get_leaf(leaf_hash))
+            .collect()
+    }
     fn insert_branch(&mut self, node: H256, branch: BranchNode) -> Result<(), Error>;
     fn insert_leaf(&mut self, leaf_hash: H256, leaf: LeafNode<V>) -> Result<(), Error>;
     fn remove_branch(&mut self, node: &H256) -> Result<(), Error>;
@@ -1,13 +1,16 @@
+#[cfg(feature = "async")]
+use crate::async_store::AsyncStore;
 use crate::{
-    collections::{BTreeMap, VecDeque},
     error::{Error, Result},
+    iter::{prefix_range, range_bounds, DiffIter, LeafIter},
     merge::{hash_leaf, merge},
-    merkle_proof::MerkleProof,
+    merkle_proof::{CompiledMerkleProof, MerkleProof, RangeProof},
     traits::{Hasher, Store, Value},
+    tree_diff::TreeDiff,
     vec::Vec,
     EXPECTED_PATH_SIZE, H256,
 };
-use core::{cmp::max, marker::PhantomData};
+use core::{cmp::max, marker::PhantomData, ops::RangeBounds};
 
 /// A branch in the SMT
 #[derive(Debug, Eq, PartialEq, Clone)]
@@ -19,7 +22,7 @@ pub struct BranchNode {
 
 impl BranchNode {
     // get node at a specific height
-    fn node_at(&self, height: u8) -> NodeType {
+    pub(crate) fn node_at(&self, height: u8) -> NodeType {
         match self.node_type {
             NodeType::Pair(node, sibling) => {
                 let is_right = self.key.get_bit(height);
@@ -59,7 +62,18 @@ pub struct SparseMerkleTree<H, V, S> {
     phantom: PhantomData<(H, V)>,
 }
 
-impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
+/// A read-only view of the tree at a fixed root
+///
+/// Snapshots are created by `SparseMerkleTree::snapshot`, the store is cloned
+/// into the snapshot. With a `SharedStore` over a `PersistentStore` the clone
+/// is a shared handle, snapshots can be sent to other threads and read
+/// concurrently while the tree is updated.
+#[derive(Debug)]
+pub struct Snapshot<H, V, S> {
+    tree: SparseMerkleTree<H, V, S>,
+}
+
+impl<H, V, S> SparseMerkleTree<H, V, S> {
     /// Build a merkle tree from root and store
     pub fn new(root: H256, store: S) -> SparseMerkleTree<H, V, S> {
         SparseMerkleTree {
@@ -93,10 +107,86 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
     pub fn store_mut(&mut self) -> &mut S {
         &mut self.store
     }
+}
+
+impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
+    /// Build a merkle tree from key value pairs sorted by key in ascending order
+    ///
+    /// Every branch is written into store only once, and at most 256 pending
+    /// subtrees are kept in memory. Leaves with zero value are skipped.
+    /// Return UnsortedKeys error if a key is not greater than the previous one,
+    /// the store may be partially written in this case.
+    pub fn from_sorted_iter<I: IntoIterator<Item = (H256, V)>>(
+        mut store: S,
+        iter: I,
+    ) -> Result<SparseMerkleTree<H, V, S>> {
+        // pending subtrees (fork height with the previous subtree, leftmost key, node),
+        // fork heights are strictly decreasing from bottom to top
+        let mut stack: Vec<(u8, H256, H256)> = Vec::new();
+        let mut last_key: Option<H256> = None;
+        // key of the last inserted leaf
+        let mut last_leaf_key: Option<H256> = None;
+        for (key, value) in iter {
+            if last_key.map(|last_key| last_key >= key).unwrap_or(false) {
+                return Err(Error::UnsortedKeys(key));
+            }
+            last_key = Some(key);
+            let node = hash_leaf::<H>(&key, &value.to_h256());
+            if node.is_zero() {
+                continue;
+            }
+            let fork_height = last_leaf_key
+                .map(|last_leaf_key| last_leaf_key.fork_height(&key))
+                .unwrap_or(0);
+            last_leaf_key = Some(key);
+            // the keys of the new leaf and the top subtree
+            // may fork at a height lower than the nodes below
+            while stack.len() > 1 && stack[stack.len() - 1].0 < fork_height {
+                bulk_merge::<H, V, S>(&mut store, &mut stack)?;
+            }
+            store.insert_leaf(node, LeafNode { key, value })?;
+            store.insert_branch(
+                node,
+                BranchNode {
+                    key,
+                    fork_height: 0,
+                    node_type: NodeType::Single(node),
+                },
+            )?;
+            stack.push((fork_height, key, node));
+        }
+        while stack.len() > 1 {
+            bulk_merge::<H, V, S>(&mut store, &mut stack)?;
+        }
+        let root = stack.pop().map(|(_, _, node)| node).unwrap_or_default();
+        Ok(SparseMerkleTree::new(root, store))
+    }
+
+    /// Create a read-only view of the current root
+    pub fn snapshot(&self) -> Snapshot<H, V, S>
+    where
+        S: Clone,
+    {
+        Snapshot {
+            tree: SparseMerkleTree::new(self.root, self.store.clone()),
+        }
+    }
 
     /// Update a leaf, return new merkle root
     /// set to zero value to delete a key
     pub fn update(&mut self, key: H256, value: V) -> Result<&H256> {
+        let (root, diff) = self.update_diff(key, value)?;
+        diff.apply(&mut self.store)?;
+        self.root = root;
+        Ok(&self.root)
+    }
+
+    /// Compute the new merkle root and the store writes of `update`,
+    /// the store is not written
+    ///
+    /// Branches on the path which are unchanged by the update are not in the diff.
+    pub fn update_diff(&self, key: H256, value: V) -> Result<(H256, TreeDiff<V>)> {
+        let mut diff = TreeDiff::default();
         // store the path, sparse index will ignore zero members
         let mut path = Vec::new();
         if !self.is_empty() {
@@ -104,7 +194,7 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
             loop {
                 let branch_node = self
                     .store
-                    .get_branch(&node)?
+                    .get_branch_ref(&node)?
                     .ok_or_else(|| Error::MissingBranch(node))?;
                 let height = max(key.fork_height(branch_node.key()), branch_node.fork_height);
                 match branch_node.node_at(height) {
@@ -114,7 +204,7 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
                             path.push((height, node));
                             break;
                         } else {
-                            self.store.remove_branch(&node)?;
+                            diff.removed_branches.push(node);
                             let is_right = key.get_bit(height);
                             if is_right {
                                 node = right;
@@ -127,8 +217,8 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
                     }
                     NodeType::Single(node) => {
                         if &key == branch_node.key() {
-                            self.store.remove_leaf(&node)?;
-                            self.store.remove_branch(&node)?;
+                            diff.removed_leaves.push(node);
+                            diff.removed_branches.push(node);
                         } else {
                             path.push((height, node));
                         }
@@ -138,21 +228,21 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
             }
         }
 
-        // compute and store new leaf
+        // compute new leaf
         let mut node = hash_leaf::<H>(&key, &value.to_h256());
         // notice when value is zero the leaf is deleted, so we do not need to store it
         if !node.is_zero() {
-            self.store.insert_leaf(node, LeafNode { key, value })?;
+            diff.leaves.push((node, LeafNode { key, value }));
 
             // build at least one branch for leaf
-            self.store.insert_branch(
+            diff.branches.push((
                 node,
                 BranchNode {
                     key,
                     fork_height: 0,
                     node_type: NodeType::Single(node),
                 },
-            )?;
+            ));
         }
 
         // recompute the tree from bottom to top
@@ -171,14 +261,41 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
                     fork_height: height,
                     node_type: NodeType::Pair(node, sibling),
                 };
-                self.store.insert_branch(parent, branch_node)?;
+                diff.branches.push((parent, branch_node));
             }
             node = parent;
         }
-        self.root = node;
+        diff.minimize();
+        Ok((node, diff))
+    }
+
+    /// Update multiple leaves in one pass, return new merkle root
+    /// set to zero value to delete a key, the last value wins if a key is duplicated
+    ///
+    /// Unlike calling `update` in a loop, every internal node touched by the
+    /// batch is hashed and written only once.
+    /// All store writes are applied after the new root is computed, so the
+    /// store is left untouched if an error is returned while computing it.
+    /// If a store write fails, the root is not changed, see `TreeDiff::apply`.
+    pub fn update_all(&mut self, leaves: Vec<(H256, V)>) -> Result<&H256> {
+        let (root, diff) = self.update_all_diff(leaves)?;
+        diff.apply(&mut self.store)?;
+        self.root = root;
         Ok(&self.root)
     }
 
+    /// Compute the new merkle root and the store writes of `update_all`,
+    /// the store is not written
+    pub fn update_all_diff(&self, leaves: Vec<(H256, V)>) -> Result<(H256, TreeDiff<V>)> {
+        let leaves = sort_batch(leaves);
+        let updates = hash_leaves::<H, V>(&leaves);
+
+        let mut changes = BatchChanges::default();
+        let job = BatchJob::new(self.root, None, &updates);
+        let root = update_subtree::<H, V, S>(&self.store, job, &mut changes)?;
+        Ok((root, batch_diff(leaves, updates, changes)))
+    }
+
     /// Get value of a leaf
     /// return zero value if leaf not exists
     pub fn get(&self, key: &H256) -> Result<V> {
@@ -190,175 +307,1140 @@ impl<H: Hasher + Default, V: Value, S: Store<V>> SparseMerkleTree<H, V, S> {
         loop {
             let branch_node = self
                 .store
-                .get_branch(&node)?
+                .get_branch_ref(&node)?
                 .ok_or_else(|| Error::MissingBranch(node))?;
-
-            match branch_node.node_at(branch_node.fork_height) {
-                NodeType::Pair(left, right) => {
-                    let is_right = key.get_bit(branch_node.fork_height);
-                    node = if is_right { right } else { left };
-                }
-                NodeType::Single(node) => {
-                    if key == branch_node.key() {
-                        return Ok(self
-                            .store
-                            .get_leaf(&node)?
-                            .ok_or_else(|| Error::MissingLeaf(node))?
-                            .value);
-                    } else {
-                        return Ok(V::zero());
-                    }
+            match get_step(key, &branch_node) {
+                GetStep::Next(next) => node = next,
+                GetStep::Leaf(leaf) => {
+                    return Ok(self
+                        .store
+                        .get_leaf(&leaf)?
+                        .ok_or(Error::MissingLeaf(leaf))?
+                        .value);
                 }
+                GetStep::Zero => return Ok(V::zero()),
             }
         }
     }
 
-    /// fetch merkle path of key into cache
-    /// cache: (height, key) -> node
-    fn fetch_merkle_path(&self, key: &H256, cache: &mut BTreeMap<(u8, H256), H256>) -> Result<()> {
+    /// Get values of multiple leaves, in the order of keys
+    /// return zero value for the leaves not exist
+    ///
+    /// Keys are walked down together one level at a time, so the shared
+    /// branches near the root are read once, and the branches of a level are
+    /// fetched from store in one `get_branches` call, then the leaves are
+    /// fetched in one `get_leaves` call.
+    pub fn get_many(&self, keys: &[H256]) -> Result<Vec<V>> {
+        let mut walk = GetWalk::new(keys, self.root);
+        while let Some(nodes) = walk.next_nodes() {
+            let branches = self.store.get_branches(nodes)?;
+            walk.step(&branches)?;
+        }
+        let leaves = self.store.get_leaves(&walk.leaf_hashes())?;
+        walk.finish(leaves)
+    }
+
+    /// Iterate leaves with keys in range, in ascending order of keys
+    ///
+    /// The order is the order of `H256`, which is also the order of keys in
+    /// merkle proofs. Leaves are read lazily by walking branches, see `LeafIter`.
+    pub fn iter_range<R: RangeBounds<H256>>(&self, range: R) -> LeafIter<'_, V, S> {
+        let (start, end) = range_bounds(&range);
+        LeafIter::new(&self.store, self.root, start, end)
+    }
+
+    /// Iterate leaves with keys starting with the highest len bits of prefix,
+    /// in ascending order of keys
+    ///
+    /// Panics if len is larger than 256.
+    pub fn iter_prefix(&self, prefix: &H256, len: u16) -> LeafIter<'_, V, S> {
+        let (start, end) = prefix_range(prefix, len);
+        LeafIter::new(&self.store, self.root, start, end)
+    }
+
+    /// Iterate keys changed from old_root to new_root, in ascending order of keys,
+    /// yields the new value of a key or `None` if the key is deleted
+    ///
+    /// Both roots must be readable from the store, for example versions kept by
+    /// `PersistentStore`. Subtrees with the same hash are skipped, see `DiffIter`.
+    pub fn diff(&self, old_root: &H256, new_root: &H256) -> DiffIter<'_, V, S> {
+        DiffIter::new(&self.store, *old_root, *new_root)
+    }
+
+    /// Generate merkle proof, duplicated keys are ignored
+    pub fn merkle_proof(&self, keys: Vec<H256>) -> Result<MerkleProof> {
+        let keys = proof_keys(keys)?;
+        let paths = self.merkle_paths(&keys)?;
+        Ok(build_merkle_proof(&keys, &paths))
+    }
+
+    /// Generate compiled merkle proof, duplicated keys are ignored
+    ///
+    /// The result is the same as compile the proof of `merkle_proof`,
+    /// but the program is emitted directly from the merkle paths.
+    pub fn compiled_merkle_proof(&self, keys: Vec<H256>) -> Result<CompiledMerkleProof> {
+        let keys = proof_keys(keys)?;
+        let paths = self.merkle_paths(&keys)?;
+        let (proof, _siblings_count) = compile_merkle_paths(&keys, &paths);
+        Ok(proof)
+    }
+
+    /// Generate a range proof of the leaves with keys in range
+    ///
+    /// Return the leaves in ascending order of keys and the proof,
+    /// return EmptyKeys error if no leaf is in range. See `RangeProof`.
+    pub fn range_proof<R: RangeBounds<H256>>(
+        &self,
+        range: R,
+    ) -> Result<(Vec<LeafNode<V>>, RangeProof)> {
+        let leaves = self.iter_range(range).collect::<Result<Vec<_>>>()?;
+        let (first, last) = match (leaves.first(), leaves.last()) {
+            (Some(first), Some(last)) => (first.key, last.key),
+            _ => return Err(Error::EmptyKeys),
+        };
+        let mut keys = Vec::with_capacity(2);
+        keys.push(first);
+        if first != last {
+            keys.push(last);
+        }
+        let paths = self.merkle_paths(&keys)?;
+        if keys.len() == 1 {
+            return Ok((leaves, RangeProof::new(paths.siblings, Vec::new())));
+        }
+        // siblings inside the range are merged from the leaves,
+        // siblings above the leaves are on the path of the first key
+        let top = first.fork_height(&last);
+        let left = paths
+            .siblings(0)
+            .iter()
+            .copied()
+            .filter(|(height, _sibling)| first.get_bit(*height) || *height > top)
+            .collect();
+        let right = paths
+            .siblings(1)
+            .iter()
+            .copied()
+            .filter(|(height, _sibling)| !last.get_bit(*height) && *height < top)
+            .collect();
+        Ok((leaves, RangeProof::new(left, right)))
+    }
+
+    /// Fetch the non-zero siblings on merkle paths of sorted keys
+    ///
+    /// Paths are walked down one level at a time,
+    /// so the branches of a level are fetched from store in one call.
+    fn merkle_paths(&self, keys: &[H256]) -> Result<MerklePaths> {
+        let mut walk = PathsWalk::new(keys, self.root);
+        while let Some(nodes) = walk.next_nodes() {
+            let branches = self.store.get_branches(nodes)?;
+            walk.step(&branches)?;
+        }
+        Ok(walk.finish())
+    }
+}
+
+impl<H: Hasher + Default, V: Value, S: Store<V>> Snapshot<H, V, S> {
+    /// Merkle root of the snapshot
+    pub fn root(&self) -> &H256 {
+        self.tree.root()
+    }
+
+    /// Check empty of the snapshot
+    pub fn is_empty(&self) -> bool {
+        self.tree.is_empty()
+    }
+
+    /// Get backend store
+    pub fn store(&self) -> &S {
+        self.tree.store()
+    }
+
+    /// Get value of a leaf, see `SparseMerkleTree::get`
+    pub fn get(&self, key: &H256) -> Result<V> {
+        self.tree.get(key)
+    }
+
+    /// Iterate leaves in range, see `SparseMerkleTree::iter_range`
+    pub fn iter_range<R: RangeBounds<H256>>(&self, range: R) -> LeafIter<'_, V, S> {
+        self.tree.iter_range(range)
+    }
+
+    /// Iterate leaves with prefix, see `SparseMerkleTree::iter_prefix`
+    pub fn iter_prefix(&self, prefix: &H256, len: u16) -> LeafIter<'_, V, S> {
+        self.tree.iter_prefix(prefix, len)
+    }
+
+    /// Generate merkle proof, see `SparseMerkleTree::merkle_proof`
+    pub fn merkle_proof(&self, keys: Vec<H256>) -> Result<MerkleProof> {
+        self.tree.merkle_proof(keys)
+    }
+
+    /// Generate compiled merkle proof, see `SparseMerkleTree::compiled_merkle_proof`
+    pub fn compiled_merkle_proof(&self, keys: Vec<H256>) -> Result<CompiledMerkleProof> {
+        self.tree.compiled_merkle_proof(keys)
+    }
+}
+
+#[cfg(feature = "async")]
+impl<H: Hasher + Default, V: Value + Send, S: AsyncStore<V>> SparseMerkleTree<H, V, S> {
+    /// Async version of `get`
+    pub async fn async_get(&self, key: &H256) -> Result<V> {
+        if self.is_empty() {
+            return Ok(V::zero());
+        }
+
         let mut node = self.root;
         loop {
             let branch_node = self
                 .store
-                .get_branch(&node)?
-                .ok_or_else(|| Error::MissingBranch(node))?;
-            let height = max(key.fork_height(branch_node.key()), branch_node.fork_height);
-            let is_right = key.get_bit(height);
-            let mut sibling_key = key.parent_path(height);
-            if !is_right {
-                // mark sibling's index, sibling on the right path.
-                sibling_key.set_bit(height);
-            };
-
-            match branch_node.node_at(height) {
-                NodeType::Pair(left, right) => {
-                    if height > branch_node.fork_height {
-                        cache.entry((height, sibling_key)).or_insert(node);
-                        break;
-                    } else {
-                        let sibling;
-                        if is_right {
-                            if node == right {
-                                break;
-                            }
-                            sibling = left;
-                            node = right;
-                        } else {
-                            if node == left {
-                                break;
-                            }
-                            sibling = right;
-                            node = left;
-                        }
-                        cache.insert((height, sibling_key), sibling);
-                    }
-                }
-                NodeType::Single(node) => {
-                    if key != branch_node.key() {
-                        cache.insert((height, sibling_key), node);
-                    }
-                    break;
+                .get_branch(&node)
+                .await?
+                .ok_or(Error::MissingBranch(node))?;
+            match get_step(key, &branch_node) {
+                GetStep::Next(next) => node = next,
+                GetStep::Leaf(leaf) => {
+                    return Ok(self
+                        .store
+                        .get_leaf(&leaf)
+                        .await?
+                        .ok_or(Error::MissingLeaf(leaf))?
+                        .value);
                 }
+                GetStep::Zero => return Ok(V::zero()),
             }
         }
+    }
+
+    /// Async version of `get_many`
+    pub async fn async_get_many(&self, keys: &[H256]) -> Result<Vec<V>> {
+        let mut walk = GetWalk::new(keys, self.root);
+        while let Some(nodes) = walk.next_nodes() {
+            let branches = self.store.get_branches(nodes).await?;
+            walk.step(&branches)?;
+        }
+        let leaves = self.store.get_leaves(&walk.leaf_hashes()).await?;
+        walk.finish(leaves)
+    }
+
+    /// Async version of `merkle_proof`
+    pub async fn async_merkle_proof(&self, keys: Vec<H256>) -> Result<MerkleProof> {
+        let keys = proof_keys(keys)?;
+        let paths = self.async_merkle_paths(&keys).await?;
+        Ok(build_merkle_proof(&keys, &paths))
+    }
+
+    /// Async version of `compiled_merkle_proof`
+    pub async fn async_compiled_merkle_proof(
+        &self,
+        keys: Vec<H256>,
+    ) -> Result<CompiledMerkleProof> {
+        let keys = proof_keys(keys)?;
+        let paths = self.async_merkle_paths(&keys).await?;
+        let (proof, _siblings_count) = compile_merkle_paths(&keys, &paths);
+        Ok(proof)
+    }
+
+    /// Async version of `update_all`
+    ///
+    /// The branches of a level are fetched in one `get_branches` call,
+    /// store writes are applied one by one after the new root is computed.
+    pub async fn async_update_all(&mut self, leaves: Vec<(H256, V)>) -> Result<&H256> {
+        let leaves = sort_batch(leaves);
+        let updates = hash_leaves::<H, V>(&leaves);
+
+        let mut changes = BatchChanges::default();
+        let job = BatchJob::new(self.root, None, &updates);
+        let mut build = BatchBuild::new(job);
+        while let Some(nodes) = build.next_nodes() {
+            let branches = self.store.get_branches(nodes).await?;
+            build.step(branches, &mut changes)?;
+        }
+        let root = build.finish::<H>(&mut changes);
+
+        batch_diff(leaves, updates, changes)
+            .async_apply(&mut self.store)
+            .await?;
+        self.root = root;
+        Ok(&self.root)
+    }
+
+    /// Async version of `merkle_paths`, one `get_branches` call per level
+    async fn async_merkle_paths(&self, keys: &[H256]) -> Result<MerklePaths> {
+        let mut walk = PathsWalk::new(keys, self.root);
+        while let Some(nodes) = walk.next_nodes() {
+            let branches = self.store.get_branches(nodes).await?;
+            walk.step(&branches)?;
+        }
+        Ok(walk.finish())
+    }
+}
 
+#[cfg(feature = "rayon")]
+impl<H: Hasher + Default, V: Value + Sync, S: Store<V> + Sync> SparseMerkleTree<H, V, S> {
+    /// Parallel version of `update_all`
+    ///
+    /// Leaves are hashed on the rayon thread pool, then disjoint subtrees of
+    /// the batch are rebuilt on separate threads and merged near the root.
+    /// Each thread collects its own store writes, they are applied to the
+    /// store on the current thread after the new root is computed.
+    pub fn par_update_all(&mut self, leaves: Vec<(H256, V)>) -> Result<&H256> {
+        use rayon::prelude::*;
+
+        let leaves = sort_batch(leaves);
+        let updates: Vec<LeafUpdate> = leaves
+            .par_iter()
+            .map(|(key, value)| (*key, hash_leaf::<H>(key, &value.to_h256())))
+            .collect();
+
+        let mut changes = BatchChanges::default();
+        let job = BatchJob::new(self.root, None, &updates);
+        let root = par_update_subtree::<H, V, S>(&self.store, job, &mut changes)?;
+        batch_diff(leaves, updates, changes).apply(&mut self.store)?;
+        self.root = root;
+        Ok(&self.root)
+    }
+}
+
+enum GetStep {
+    /// The next node on the path
+    Next(H256),
+    /// The leaf of key
+    Leaf(H256),
+    /// The key is not in the tree
+    Zero,
+}
+
+/// Walk one step on the path of key in `get`
+fn get_step(key: &H256, branch_node: &BranchNode) -> GetStep {
+    match branch_node.node_at(branch_node.fork_height) {
+        NodeType::Pair(left, right) => {
+            let is_right = key.get_bit(branch_node.fork_height);
+            GetStep::Next(if is_right { right } else { left })
+        }
+        NodeType::Single(node) => {
+            if key == branch_node.key() {
+                GetStep::Leaf(node)
+            } else {
+                GetStep::Zero
+            }
+        }
+    }
+}
+
+/// Walk the paths of keys in `get_many` one level at a time,
+/// the caller fetches the branches of each level
+struct GetWalk {
+    keys: Vec<H256>,
+    // (key_index, node), sorted by key so keys under the same node are adjacent
+    paths: Vec<(usize, H256)>,
+    next_paths: Vec<(usize, H256)>,
+    nodes: Vec<H256>,
+    // (key_index, leaf hash) of the found leaves
+    leaves: Vec<(usize, H256)>,
+}
+
+impl GetWalk {
+    fn new(keys: &[H256], root: H256) -> Self {
+        let mut paths: Vec<(usize, H256)> = Vec::new();
+        if !root.is_zero() {
+            paths.extend((0..keys.len()).map(|key_index| (key_index, root)));
+            paths.sort_unstable_by_key(|(key_index, _node)| keys[*key_index]);
+        }
+        GetWalk {
+            keys: keys.to_vec(),
+            next_paths: Vec::with_capacity(paths.len()),
+            nodes: Vec::with_capacity(paths.len()),
+            leaves: Vec::with_capacity(paths.len()),
+            paths,
+        }
+    }
+
+    /// Nodes of the next level, return None if all paths are walked
+    fn next_nodes(&mut self) -> Option<&[H256]> {
+        if self.paths.is_empty() {
+            return None;
+        }
+        self.nodes.clear();
+        self.nodes
+            .extend(self.paths.iter().map(|(_key_index, node)| *node));
+        self.nodes.dedup();
+        Some(&self.nodes)
+    }
+
+    /// Walk one level with the branches of `next_nodes`
+    fn step(&mut self, branches: &[Option<BranchNode>]) -> Result<()> {
+        let mut index = 0;
+        for (key_index, node) in self.paths.drain(..) {
+            if self.nodes[index] != node {
+                index += 1;
+            }
+            let branch_node = branches
+                .get(index)
+                .and_then(Option::as_ref)
+                .ok_or(Error::MissingBranch(node))?;
+            match get_step(&self.keys[key_index], branch_node) {
+                GetStep::Next(next) => self.next_paths.push((key_index, next)),
+                GetStep::Leaf(leaf) => self.leaves.push((key_index, leaf)),
+                GetStep::Zero => {}
+            }
+        }
+        core::mem::swap(&mut self.paths, &mut self.next_paths);
         Ok(())
     }
 
-    /// Generate merkle proof
-    pub fn merkle_proof(&self, mut keys: Vec<H256>) -> Result<MerkleProof> {
-        if keys.is_empty() {
-            return Err(Error::EmptyKeys);
+    /// Hashes of the found leaves
+    fn leaf_hashes(&self) -> Vec<H256> {
+        self.leaves.iter().map(|(_key_index, leaf)| *leaf).collect()
+    }
+
+    /// Return values in the order of keys, leaves are fetched by `leaf_hashes`
+    fn finish<V: Value>(self, leaves: Vec<Option<LeafNode<V>>>) -> Result<Vec<V>> {
+        let mut values: Vec<V> = self.keys.iter().map(|_key| V::zero()).collect();
+        for ((key_index, leaf_hash), leaf) in self.leaves.into_iter().zip(leaves) {
+            values[key_index] = leaf.ok_or(Error::MissingLeaf(leaf_hash))?.value;
+        }
+        Ok(values)
+    }
+}
+
+/// Walk one step on the merkle path of key at node,
+/// return the non-zero sibling (height, sibling) and the next node on the path
+fn merkle_path_step(
+    key: &H256,
+    node: H256,
+    branch_node: &BranchNode,
+) -> (Option<(u8, H256)>, Option<H256>) {
+    let height = max(key.fork_height(branch_node.key()), branch_node.fork_height);
+    match branch_node.node_at(height) {
+        NodeType::Pair(left, right) => {
+            if height > branch_node.fork_height {
+                // the path forks above node, node is the sibling
+                (Some((height, node)), None)
+            } else {
+                let (sibling, next) = if key.get_bit(height) {
+                    (left, right)
+                } else {
+                    (right, left)
+                };
+                if node == next {
+                    return (None, None);
+                }
+                (Some((height, sibling)), Some(next))
+            }
+        }
+        NodeType::Single(node) => {
+            if key != branch_node.key() {
+                (Some((height, node)), None)
+            } else {
+                (None, None)
+            }
+        }
+    }
+}
+
+/// Walk the merkle paths of sorted keys one level at a time,
+/// the caller fetches the branches of each level
+struct PathsWalk<'a> {
+    keys: &'a [H256],
+    // (key_index, height, sibling)
+    siblings: Vec<(usize, u8, H256)>,
+    // (key_index, node), sorted keys under the same node are adjacent
+    paths: Vec<(usize, H256)>,
+    next_paths: Vec<(usize, H256)>,
+    nodes: Vec<H256>,
+}
+
+impl<'a> PathsWalk<'a> {
+    fn new(keys: &'a [H256], root: H256) -> Self {
+        let paths = if root.is_zero() {
+            Vec::new()
+        } else {
+            (0..keys.len()).map(|i| (i, root)).collect()
+        };
+        PathsWalk {
+            keys,
+            siblings: Vec::with_capacity(EXPECTED_PATH_SIZE * keys.len()),
+            next_paths: Vec::with_capacity(paths.len()),
+            nodes: Vec::with_capacity(paths.len()),
+            paths,
         }
+    }
 
-        // sort keys
-        keys.sort_unstable();
+    /// Nodes of the next level, return None if all paths are walked
+    fn next_nodes(&mut self) -> Option<&[H256]> {
+        if self.paths.is_empty() {
+            return None;
+        }
+        self.nodes.clear();
+        self.nodes
+            .extend(self.paths.iter().map(|(_key_index, node)| *node));
+        self.nodes.dedup();
+        Some(&self.nodes)
+    }
 
-        // fetch all merkle path
-        let mut cache: BTreeMap<(u8, H256), H256> = Default::default();
-        if !self.is_empty() {
-            for k in &keys {
-                self.fetch_merkle_path(k, &mut cache)?;
+    /// Walk one level with the branches of `next_nodes`
+    fn step(&mut self, branches: &[Option<BranchNode>]) -> Result<()> {
+        let mut index = 0;
+        for (key_index, node) in self.paths.drain(..) {
+            if self.nodes[index] != node {
+                index += 1;
+            }
+            let branch_node = branches
+                .get(index)
+                .and_then(Option::as_ref)
+                .ok_or(Error::MissingBranch(node))?;
+            let (sibling, next) = merkle_path_step(&self.keys[key_index], node, branch_node);
+            if let Some((height, sibling)) = sibling {
+                self.siblings.push((key_index, height, sibling));
+            }
+            if let Some(next) = next {
+                self.next_paths.push((key_index, next));
             }
         }
+        core::mem::swap(&mut self.paths, &mut self.next_paths);
+        Ok(())
+    }
 
-        // (node, height)
-        let mut proof: Vec<(H256, u8)> = Vec::with_capacity(EXPECTED_PATH_SIZE * keys.len());
-        // key_index -> merkle path height
-        let mut leaves_path: Vec<Vec<u8>> = Vec::with_capacity(keys.len());
-        leaves_path.resize_with(keys.len(), Default::default);
+    fn finish(self) -> MerklePaths {
+        MerklePaths::new(self.keys.len(), self.siblings)
+    }
+}
 
-        let keys_len = keys.len();
-        // build merkle proofs from bottom to up
-        // (key, height, key_index)
-        let mut queue: VecDeque<(H256, u8, usize)> = keys
+/// Non-zero siblings on the merkle paths of sorted keys
+pub(crate) struct MerklePaths {
+    /// (height, sibling) sorted by key then height
+    pub(crate) siblings: Vec<(u8, H256)>,
+    /// siblings of the i-th key are in `offsets[i]..offsets[i + 1]`
+    offsets: Vec<usize>,
+}
+
+impl MerklePaths {
+    /// Group (key_index, height, sibling) by key
+    pub(crate) fn new(keys_count: usize, mut siblings: Vec<(usize, u8, H256)>) -> Self {
+        siblings.sort_unstable_by_key(|(key_index, height, _sibling)| (*key_index, *height));
+        let mut offsets = Vec::with_capacity(keys_count + 1);
+        let mut offset = 0;
+        for key_index in 0..=keys_count {
+            while offset < siblings.len() && siblings[offset].0 < key_index {
+                offset += 1;
+            }
+            offsets.push(offset);
+        }
+        let siblings = siblings
             .into_iter()
-            .enumerate()
-            .map(|(i, k)| (k, 0, i))
+            .map(|(_key_index, height, sibling)| (height, sibling))
             .collect();
+        MerklePaths { siblings, offsets }
+    }
 
-        while let Some((key, height, leaf_index)) = queue.pop_front() {
-            if queue.is_empty() && cache.is_empty() {
-                // tree only contains one leaf
-                if leaves_path[leaf_index].is_empty() {
-                    leaves_path[leaf_index].push(core::u8::MAX);
-                }
+    fn siblings(&self, key_index: usize) -> &[(u8, H256)] {
+        &self.siblings[self.offsets[key_index]..self.offsets[key_index + 1]]
+    }
+}
+
+/// Operations to rebuild the root from proved keys
+enum ProofOp {
+    /// Push the leaf of key_index
+    Leaf(usize),
+    /// Merge the subtree of key_index with a non-zero sibling at height
+    Proof(usize, u8, H256),
+    /// Merge the subtree of key_index with the subtree of sibling_index at height
+    Merge(usize, usize, u8),
+}
+
+/// Walk the tree of proved keys in postorder
+///
+/// Subtrees are identified by their first key, the merkle path of the key
+/// above the subtree is also the merkle path of the subtree.
+/// Keys are merged with a stack of subtrees like `from_sorted_iter`,
+/// before visiting a key, the subtree on the stack top is raised to the
+/// height it forks with the key, so the operations come in postorder.
+fn walk_proof_tree<F: FnMut(ProofOp)>(keys: &[H256], paths: &MerklePaths, mut f: F) {
+    /// A subtree on the stack
+    struct Subtree {
+        /// fork height with the previous subtree
+        fork_height: u8,
+        key_index: usize,
+        /// siblings below height are visited
+        height: u16,
+        /// index of the next sibling
+        cursor: usize,
+    }
+
+    /// Visit siblings of subtree below target height
+    fn raise<F: FnMut(ProofOp)>(
+        paths: &MerklePaths,
+        subtree: &mut Subtree,
+        target: u16,
+        f: &mut F,
+    ) {
+        let siblings = paths.siblings(subtree.key_index);
+        while let Some(&(height, sibling)) = siblings.get(subtree.cursor) {
+            if u16::from(height) >= target {
                 break;
             }
-            // compute sibling key
-            let mut sibling_key = key.parent_path(height);
+            if u16::from(height) >= subtree.height {
+                f(ProofOp::Proof(subtree.key_index, height, sibling));
+            }
+            subtree.cursor += 1;
+        }
+        subtree.height = target;
+    }
 
-            let is_right = key.get_bit(height);
-            if is_right {
-                // sibling on left
-                sibling_key.clear_bit(height);
+    /// Merge the stack top subtree into the previous one
+    fn merge_top<F: FnMut(ProofOp)>(paths: &MerklePaths, stack: &mut Vec<Subtree>, f: &mut F) {
+        let mut top = stack.pop().expect("top subtree");
+        let height = top.fork_height;
+        raise(paths, &mut top, height.into(), f);
+        let previous = stack.last_mut().expect("previous subtree");
+        f(ProofOp::Merge(previous.key_index, top.key_index, height));
+        previous.height = u16::from(height) + 1;
+    }
+
+    let mut stack: Vec<Subtree> = Vec::new();
+    for (key_index, key) in keys.iter().enumerate() {
+        let fork_height = match key_index.checked_sub(1) {
+            Some(last_index) => keys[last_index].fork_height(key),
+            None => 0,
+        };
+        while stack.len() > 1 && stack[stack.len() - 1].fork_height < fork_height {
+            merge_top(paths, &mut stack, &mut f);
+        }
+        if let Some(top) = stack.last_mut() {
+            raise(paths, top, fork_height.into(), &mut f);
+        }
+        f(ProofOp::Leaf(key_index));
+        stack.push(Subtree {
+            fork_height,
+            key_index,
+            height: 0,
+            cursor: 0,
+        });
+    }
+    while stack.len() > 1 {
+        merge_top(paths, &mut stack, &mut f);
+    }
+    if let Some(top) = stack.last_mut() {
+        raise(paths, top, 256, &mut f);
+    }
+}
+
+/// Sort keys of a proof and remove duplicated keys
+pub(crate) fn proof_keys(mut keys: Vec<H256>) -> Result<Vec<H256>> {
+    if keys.is_empty() {
+        return Err(Error::EmptyKeys);
+    }
+    keys.sort_unstable();
+    keys.dedup();
+    Ok(keys)
+}
+
+/// Build the merkle proof of sorted keys from their merkle paths
+pub(crate) fn build_merkle_proof(keys: &[H256], paths: &MerklePaths) -> MerkleProof {
+    // key_index -> merkle path height
+    let mut leaves_path: Vec<Vec<u8>> = Vec::with_capacity(keys.len());
+    leaves_path.resize_with(keys.len(), Default::default);
+    // (height, key_index, node)
+    let mut proof: Vec<(u8, usize, H256)> = Vec::with_capacity(paths.siblings.len());
+    walk_proof_tree(keys, paths, |op| match op {
+        ProofOp::Leaf(_key_index) => {}
+        ProofOp::Proof(key_index, height, sibling) => {
+            leaves_path[key_index].push(height);
+            proof.push((height, key_index, sibling));
+        }
+        ProofOp::Merge(key_index, sibling_index, height) => {
+            leaves_path[key_index].push(height);
+            leaves_path[sibling_index].push(height);
+        }
+    });
+    // the tree only contains one leaf
+    if leaves_path[0].is_empty() {
+        leaves_path[0].push(core::u8::MAX);
+    }
+    // siblings are consumed from bottom to top, level by level
+    proof.sort_unstable_by_key(|(height, key_index, _node)| (*height, *key_index));
+    let proof = proof
+        .into_iter()
+        .map(|(height, _key_index, node)| (node, height))
+        .collect();
+    MerkleProof::new(leaves_path, proof)
+}
+
+/// Emit the compiled proof of sorted keys from their merkle paths,
+/// return the proof and the number of siblings in the proof
+pub(crate) fn compile_merkle_paths(
+    keys: &[H256],
+    paths: &MerklePaths,
+) -> (CompiledMerkleProof, usize) {
+    let mut program = Vec::with_capacity(keys.len() * 3 + paths.siblings.len() * 34);
+    let mut siblings_count = 0;
+    walk_proof_tree(keys, paths, |op| match op {
+        ProofOp::Leaf(_key_index) => program.push(0x4C),
+        ProofOp::Proof(_key_index, height, sibling) => {
+            program.push(0x50);
+            program.push(height);
+            program.extend_from_slice(sibling.as_slice());
+            siblings_count += 1;
+        }
+        ProofOp::Merge(_key_index, _sibling_index, height) => {
+            program.push(0x48);
+            program.push(height);
+        }
+    });
+    (CompiledMerkleProof(program), siblings_count)
+}
+
+/// (key, leaf hash) of an update in a batch
+type LeafUpdate = (H256, H256);
+
+/// Sort a batch by key and remove duplicated keys, the last value wins
+fn sort_batch<V>(mut leaves: Vec<(H256, V)>) -> Vec<(H256, V)> {
+    // the stable sort keeps reversed order for duplicated keys,
+    // so dedup keeps the last written value
+    leaves.reverse();
+    leaves.sort_by_key(|(key, _value)| *key);
+    leaves.dedup_by_key(|(key, _value)| *key);
+    leaves
+}
+
+/// Store writes collected by a batch update
+#[derive(Default)]
+struct BatchChanges {
+    removed_leaves: Vec<H256>,
+    removed_branches: Vec<H256>,
+    branches: Vec<(H256, BranchNode)>,
+}
+
+/// Collect the store writes of a batch update into a minimal diff
+fn batch_diff<V>(
+    leaves: Vec<(H256, V)>,
+    updates: Vec<LeafUpdate>,
+    changes: BatchChanges,
+) -> TreeDiff<V> {
+    let mut diff = TreeDiff {
+        removed_leaves: changes.removed_leaves,
+        removed_branches: changes.removed_branches,
+        leaves: Vec::with_capacity(leaves.len()),
+        branches: changes.branches,
+    };
+    for ((key, value), (_key, node)) in leaves.into_iter().zip(updates) {
+        // notice when value is zero the leaf is deleted, so we do not need to store it
+        if !node.is_zero() {
+            diff.leaves.push((node, LeafNode { key, value }));
+            diff.branches.push((
+                node,
+                BranchNode {
+                    key,
+                    fork_height: 0,
+                    node_type: NodeType::Single(node),
+                },
+            ));
+        }
+    }
+    diff.minimize();
+    diff
+}
+
+#[cfg(feature = "rayon")]
+impl BatchChanges {
+    fn append(&mut self, mut other: BatchChanges) {
+        self.removed_leaves.append(&mut other.removed_leaves);
+        self.removed_branches.append(&mut other.removed_branches);
+        self.branches.append(&mut other.branches);
+    }
+}
+
+/// A subtree to rebuild in a batch update
+/// node: the current subtree, zero for an empty subtree
+/// branch: the branch of node if it is already fetched
+/// updates: sorted (key, leaf hash) pairs which located in the subtree
+struct BatchJob<'a> {
+    node: H256,
+    branch: Option<BranchNode>,
+    updates: &'a [LeafUpdate],
+}
+
+impl<'a> BatchJob<'a> {
+    fn new(node: H256, branch: Option<BranchNode>, updates: &'a [LeafUpdate]) -> Self {
+        BatchJob {
+            node,
+            branch,
+            updates,
+        }
+    }
+
+    /// Check if the branch of node must be fetched to rebuild the subtree
+    fn requires_branch(&self) -> bool {
+        !self.updates.is_empty() && !self.node.is_zero() && self.branch.is_none()
+    }
+}
+
+enum BatchStep<'a> {
+    /// The subtree is rebuilt into a node
+    Done(H256),
+    /// The subtree forks at height, rebuild both sides then merge them,
+    /// key is used to tell which side of the merged branch is node.
+    Split {
+        height: u8,
+        key: H256,
+        left: BatchJob<'a>,
+        right: BatchJob<'a>,
+    },
+}
+
+/// Split sorted updates by the bit at height,
+/// all the keys must have the same bits above height.
+fn split_updates(updates: &[LeafUpdate], height: u8) -> (&[LeafUpdate], &[LeafUpdate]) {
+    let mid = updates.partition_point(|(key, _node)| !key.get_bit(height));
+    updates.split_at(mid)
+}
+
+/// Rebuild one level of a batch job
+///
+/// The branch of the job must be fetched if the job requires it.
+fn batch_step<'a>(job: BatchJob<'a>, changes: &mut BatchChanges) -> Result<BatchStep<'a>> {
+    let BatchJob {
+        node,
+        branch,
+        updates,
+    } = job;
+    if updates.is_empty() {
+        return Ok(BatchStep::Done(node));
+    }
+
+    if node.is_zero() {
+        // skip zero leaves, there is nothing to delete in an empty subtree
+        let start = updates.iter().position(|(_key, node)| !node.is_zero());
+        let end = updates.iter().rposition(|(_key, node)| !node.is_zero());
+        let updates = match (start, end) {
+            (Some(start), Some(end)) => &updates[start..=end],
+            _ => return Ok(BatchStep::Done(H256::zero())),
+        };
+        if updates.len() == 1 {
+            return Ok(BatchStep::Done(updates[0].1));
+        }
+        let key = updates[0].0;
+        let height = key.fork_height(&updates[updates.len() - 1].0);
+        let (left, right) = split_updates(updates, height);
+        return Ok(BatchStep::Split {
+            height,
+            key,
+            left: BatchJob::new(node, None, left),
+            right: BatchJob::new(node, None, right),
+        });
+    }
+
+    let branch_node = branch.ok_or(Error::MissingBranch(node))?;
+    // the keys of sorted updates diverge most from the node at both ends
+    let height = max(
+        branch_node.key().fork_height(&updates[0].0),
+        branch_node.key().fork_height(&updates[updates.len() - 1].0),
+    );
+    let key = branch_node.key;
+    match branch_node.node_at(branch_node.fork_height) {
+        NodeType::Pair(left, right) if height <= branch_node.fork_height => {
+            // updates are under the node, rebuild both children
+            changes.removed_branches.push(node);
+            let height = branch_node.fork_height;
+            let (left_updates, right_updates) = split_updates(updates, height);
+            Ok(BatchStep::Split {
+                height,
+                key,
+                left: BatchJob::new(left, None, left_updates),
+                right: BatchJob::new(right, None, right_updates),
+            })
+        }
+        NodeType::Single(leaf) if updates.len() == 1 && updates[0].0 == key => {
+            // replace the leaf
+            changes.removed_leaves.push(leaf);
+            changes.removed_branches.push(node);
+            Ok(BatchStep::Done(updates[0].1))
+        }
+        _ => {
+            // updates fork from the node above its fork height,
+            // the node is kept and merged with its new sibling
+            let (left_updates, right_updates) = split_updates(updates, height);
+            let (left, right) = if key.get_bit(height) {
+                (
+                    BatchJob::new(H256::zero(), None, left_updates),
+                    BatchJob::new(node, Some(branch_node), right_updates),
+                )
             } else {
-                // sibling on right
-                sibling_key.set_bit(height);
-            }
-            if Some((&sibling_key, &height))
-                == queue
-                    .front()
-                    .map(|(sibling_key, height, _leaf_index)| (sibling_key, height))
-            {
-                // drop the sibling, mark sibling's merkle path
-                let (_sibling_key, height, leaf_index) = queue.pop_front().unwrap();
-                leaves_path[leaf_index].push(height);
+                (
+                    BatchJob::new(node, Some(branch_node), left_updates),
+                    BatchJob::new(H256::zero(), None, right_updates),
+                )
+            };
+            Ok(BatchStep::Split {
+                height,
+                key,
+                left,
+                right,
+            })
+        }
+    }
+}
+
+/// Hash leaves of a batch with `Hasher::hash_pairs`
+fn hash_leaves<H: Hasher + Default, V: Value>(leaves: &[(H256, V)]) -> Vec<LeafUpdate> {
+    let values: Vec<H256> = leaves.iter().map(|(_key, value)| value.to_h256()).collect();
+    // zero value deletes the leaf, so it's hash is zero
+    let pairs: Vec<(H256, H256)> = leaves
+        .iter()
+        .zip(&values)
+        .filter(|(_leaf, value)| !value.is_zero())
+        .map(|((key, _value), value)| (*key, *value))
+        .collect();
+    let mut hashes = Vec::new();
+    hashes.resize(pairs.len(), H256::zero());
+    H::hash_pairs(&pairs, &mut hashes);
+    let mut hashes = hashes.into_iter();
+    leaves
+        .iter()
+        .zip(values)
+        .map(|((key, _value), value)| {
+            if value.is_zero() {
+                (*key, H256::zero())
             } else {
-                match cache.remove(&(height, sibling_key)) {
-                    Some(sibling) => {
-                        // save first non-zero sibling's height for leaves
-                        proof.push((sibling, height));
-                    }
-                    None => {
-                        // skip zero siblings
-                        if !is_right {
-                            sibling_key.clear_bit(height);
-                        }
-                        if height == core::u8::MAX {
-                            if leaves_path[leaf_index].is_empty() {
-                                leaves_path[leaf_index].push(height);
-                            }
-                            break;
-                        } else {
-                            let parent_key = sibling_key;
-                            queue.push_back((parent_key, height + 1, leaf_index));
-                            continue;
-                        }
-                    }
+                (*key, hashes.next().expect("leaf hash"))
+            }
+        })
+        .collect()
+}
+
+/// Merge rebuilt children of a split batch job
+#[cfg(feature = "rayon")]
+fn batch_merge<H: Hasher + Default>(
+    height: u8,
+    key: H256,
+    left: H256,
+    right: H256,
+    changes: &mut BatchChanges,
+) -> H256 {
+    let parent = merge::<H>(&left, &right);
+    push_batch_branch(height, key, left, right, parent, changes);
+    parent
+}
+
+/// Record the branch of a merged node
+fn push_batch_branch(
+    height: u8,
+    key: H256,
+    left: H256,
+    right: H256,
+    parent: H256,
+    changes: &mut BatchChanges,
+) {
+    // a zero child means the parent is the other child, which already has a branch
+    if !left.is_zero() && !right.is_zero() {
+        let node_type = if key.get_bit(height) {
+            NodeType::Pair(right, left)
+        } else {
+            NodeType::Pair(left, right)
+        };
+        let branch_node = BranchNode {
+            key,
+            fork_height: height,
+            node_type,
+        };
+        changes.branches.push((parent, branch_node));
+    }
+}
+
+/// Merge the top two subtrees of a bulk build stack
+fn bulk_merge<H: Hasher + Default, V, S: Store<V>>(
+    store: &mut S,
+    stack: &mut Vec<(u8, H256, H256)>,
+) -> Result<()> {
+    let (height, _right_key, right) = stack.pop().expect("right subtree");
+    let (fork_height, key, left) = stack.pop().expect("left subtree");
+    let parent = merge::<H>(&left, &right);
+    store.insert_branch(
+        parent,
+        BranchNode {
+            key,
+            fork_height: height,
+            node_type: NodeType::Pair(left, right),
+        },
+    )?;
+    stack.push((fork_height, key, parent));
+    Ok(())
+}
+
+/// Rebuild a subtree from bottom to top, return the new node
+///
+/// Jobs are processed one level at a time,
+/// so the branches of a level are fetched from store in one call,
+/// and the nodes of a level are hashed in one `Hasher::hash_pairs` call.
+fn update_subtree<H: Hasher + Default, V, S: Store<V>>(
+    store: &S,
+    job: BatchJob,
+    changes: &mut BatchChanges,
+) -> Result<H256> {
+    let mut build = BatchBuild::new(job);
+    while let Some(nodes) = build.next_nodes() {
+        let branches = store.get_branches(nodes)?;
+        build.step(branches, changes)?;
+    }
+    Ok(build.finish::<H>(changes))
+}
+
+/// Rebuild a subtree level by level, the caller fetches the branches of each level
+struct BatchBuild<'a> {
+    // rebuilt nodes, split jobs write their children into the following slots
+    nodes: Vec<H256>,
+    // (height, key, slot of left child, slot of parent)
+    splits: Vec<(u8, H256, usize, usize)>,
+    // end of splits of each level
+    level_ends: Vec<usize>,
+    // (slot, job) of current level
+    level: Vec<(usize, BatchJob<'a>)>,
+    fetch_nodes: Vec<H256>,
+}
+
+impl<'a> BatchBuild<'a> {
+    fn new(job: BatchJob<'a>) -> Self {
+        let mut nodes = Vec::with_capacity(job.updates.len() * 2);
+        nodes.push(H256::zero());
+        BatchBuild {
+            nodes,
+            splits: Vec::new(),
+            level_ends: Vec::new(),
+            level: Vec::from([(0, job)]),
+            fetch_nodes: Vec::new(),
+        }
+    }
+
+    /// Branches to fetch for the current level, return None if all levels are split
+    fn next_nodes(&mut self) -> Option<&[H256]> {
+        if self.level.is_empty() {
+            return None;
+        }
+        self.fetch_nodes.clear();
+        self.fetch_nodes.extend(
+            self.level
+                .iter()
+                .filter(|(_slot, job)| job.requires_branch())
+                .map(|(_slot, job)| job.node),
+        );
+        Some(&self.fetch_nodes)
+    }
+
+    /// Split the current level with the branches of `next_nodes`
+    fn step(
+        &mut self,
+        branches: Vec<Option<BranchNode>>,
+        changes: &mut BatchChanges,
+    ) -> Result<()> {
+        let mut branches = branches.into_iter();
+        let level = core::mem::take(&mut self.level);
+        let mut next_level = Vec::with_capacity(level.len() * 2);
+        for (slot, mut job) in level {
+            if job.requires_branch() {
+                let branch_node = branches.next().flatten();
+                job.branch = Some(branch_node.ok_or(Error::MissingBranch(job.node))?);
+            }
+            match batch_step(job, changes)? {
+                BatchStep::Done(node) => self.nodes[slot] = node,
+                BatchStep::Split {
+                    height,
+                    key,
+                    left,
+                    right,
+                } => {
+                    let left_slot = self.nodes.len();
+                    self.nodes.extend_from_slice(&[H256::zero(), H256::zero()]);
+                    self.splits.push((height, key, left_slot, slot));
+                    next_level.push((left_slot, left));
+                    next_level.push((left_slot + 1, right));
                 }
             }
-            // find new non-zero sibling, append to leaf's path
-            leaves_path[leaf_index].push(height);
-            if height == core::u8::MAX {
-                break;
-            } else {
-                // get parent_key, which k.get_bit(height) is false
-                let parent_key = if is_right { sibling_key } else { key };
-                queue.push_back((parent_key, height + 1, leaf_index));
+        }
+        self.level_ends.push(self.splits.len());
+        self.level = next_level;
+        Ok(())
+    }
+
+    /// Merge split jobs from bottom to top, return the new node
+    fn finish<H: Hasher + Default>(mut self, changes: &mut BatchChanges) -> H256 {
+        // children are always split at deeper levels than their parents
+        let mut pairs = Vec::new();
+        let mut hashes = Vec::new();
+        let mut level_end = self.splits.len();
+        for level_start in self.level_ends.into_iter().rev().skip(1).chain(Some(0)) {
+            let level_splits = &self.splits[level_start..level_end];
+            level_end = level_start;
+            let nodes = &mut self.nodes;
+            pairs.clear();
+            pairs.extend(
+                level_splits
+                    .iter()
+                    .map(|(_height, _key, left_slot, _slot)| {
+                        (nodes[*left_slot], nodes[left_slot + 1])
+                    })
+                    .filter(|(left, right)| !left.is_zero() && !right.is_zero()),
+            );
+            hashes.clear();
+            hashes.resize(pairs.len(), H256::zero());
+            H::hash_pairs(&pairs, &mut hashes);
+            let mut hashes = hashes.iter();
+            for (height, key, left_slot, slot) in level_splits {
+                let (left, right) = (nodes[*left_slot], nodes[left_slot + 1]);
+                let parent = if !left.is_zero() && !right.is_zero() {
+                    *hashes.next().expect("merged hash")
+                } else {
+                    merge::<H>(&left, &right)
+                };
+                push_batch_branch(*height, *key, left, right, parent, changes);
+                nodes[*slot] = parent;
             }
         }
-        debug_assert_eq!(leaves_path.len(), keys_len);
-        Ok(MerkleProof::new(leaves_path, proof))
+        self.nodes[0]
+    }
+}
+
+/// Batch jobs with fewer updates are rebuilt on the current thread
+#[cfg(feature = "rayon")]
+const PARALLEL_MIN_UPDATES: usize = 512;
+
+/// Parallel version of `update_subtree`, both sides of a split are rebuilt
+/// with `rayon::join` until the jobs are small enough.
+#[cfg(feature = "rayon")]
+fn par_update_subtree<H: Hasher + Default, V, S: Store<V> + Sync>(
+    store: &S,
+    job: BatchJob,
+    changes: &mut BatchChanges,
+) -> Result<H256> {
+    if job.updates.len() < PARALLEL_MIN_UPDATES {
+        return update_subtree::<H, V, S>(store, job, changes);
+    }
+    let mut job = job;
+    if job.requires_branch() {
+        job.branch = Some(
+            store
+                .get_branch(&job.node)?
+                .ok_or(Error::MissingBranch(job.node))?,
+        );
+    }
+    match batch_step(job, changes)? {
+        BatchStep::Done(node) => Ok(node),
+        BatchStep::Split {
+            height,
+            key,
+            left,
+            right,
+        } => {
+            let rebuild = |job| -> Result<(H256, BatchChanges)> {
+                let mut changes = BatchChanges::default();
+                let node = par_update_subtree::<H, V, S>(store, job, &mut changes)?;
+                Ok((node, changes))
+            };
+            let (left, right) = rayon::join(|| rebuild(left), || rebuild(right));
+            let (left, left_changes) = left?;
+            let (right, right_changes) = right?;
+            changes.append(left_changes);
+            changes.append(right_changes);
+            Ok(batch_merge::<H>(height, key, left, right, changes))
+        }
     }
 }
@@ -0,0 +1,115 @@
+#[cfg(feature = "async")]
+use crate::async_store::AsyncStore;
+use crate::{
+    error::Result,
+    traits::Store,
+    tree::{BranchNode, LeafNode},
+    vec::Vec,
+    H256,
+};
+
+/// Store writes of an update
+///
+/// A diff created by the tree is minimal: nodes removed then inserted with
+/// the same hash are unchanged and not in the diff, so updating a leaf with
+/// its current value writes nothing, and no node is both removed and inserted.
+/// `apply` inserts new nodes before removing obsolete nodes, if a write fails
+/// while inserting, the nodes of the old root are all still in the store. Callers can write the diff into their own write batch and
+/// rebuild the tree by `SparseMerkleTree::new` with the new root.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TreeDiff<V> {
+    pub removed_leaves: Vec<H256>,
+    pub removed_branches: Vec<H256>,
+    pub leaves: Vec<(H256, LeafNode<V>)>,
+    pub branches: Vec<(H256, BranchNode)>,
+}
+
+impl<V> Default for TreeDiff<V> {
+    fn default() -> Self {
+        TreeDiff {
+            removed_leaves: Vec::new(),
+            removed_branches: Vec::new(),
+            leaves: Vec::new(),
+            branches: Vec::new(),
+        }
+    }
+}
+
+/// Remove the nodes which are both removed and inserted
+fn drop_reinserted<T>(removed: &mut Vec<H256>, inserted: &mut Vec<(H256, T)>) {
+    if removed.is_empty() || inserted.is_empty() {
+        return;
+    }
+    removed.sort_unstable();
+    removed.dedup();
+    let mut reinserted = Vec::new();
+    inserted.retain(|(node, _)| {
+        let is_removed = removed.binary_search(node).is_ok();
+        if is_removed {
+            reinserted.push(*node);
+        }
+        !is_removed
+    });
+    if !reinserted.is_empty() {
+        reinserted.sort_unstable();
+        removed.retain(|node| reinserted.binary_search(node).is_err());
+    }
+}
+
+impl<V> TreeDiff<V> {
+    /// Check the diff writes nothing
+    pub fn is_empty(&self) -> bool {
+        self.removed_leaves.is_empty()
+            && self.removed_branches.is_empty()
+            && self.leaves.is_empty()
+            && self.branches.is_empty()
+    }
+
+    /// Drop nodes which are removed then inserted back,
+    /// a node is identified by its hash so the stored node is still valid
+    pub(crate) fn minimize(&mut self) {
+        drop_reinserted(&mut self.removed_leaves, &mut self.leaves);
+        drop_reinserted(&mut self.removed_branches, &mut self.branches);
+    }
+
+    /// Write the diff into store, new nodes first then obsolete nodes are removed
+    ///
+    /// The writes are not atomic, if an error is returned while removing,
+    /// some nodes of the old root may already be removed.
+    pub fn apply<S: Store<V>>(self, store: &mut S) -> Result<()> {
+        for (leaf_hash, leaf) in self.leaves {
+            store.insert_leaf(leaf_hash, leaf)?;
+        }
+        for (node, branch) in self.branches {
+            store.insert_branch(node, branch)?;
+        }
+        for leaf_hash in self.removed_leaves {
+            store.remove_leaf(&leaf_hash)?;
+        }
+        for node in self.removed_branches {
+            store.remove_branch(&node)?;
+        }
+        Ok(())
+    }
+
+    /// Write the diff into async store, see `apply`
+    #[cfg(feature = "async")]
+    pub async fn async_apply<S: AsyncStore<V>>(self, store: &mut S) -> Result<()>
+    where
+        V: Send,
+    {
+        for (leaf_hash, leaf) in self.leaves {
+            store.insert_leaf(leaf_hash, leaf).await?;
+        }
+        for (node, branch) in self.branches {
+            store.insert_branch(node, branch).await?;
+        }
+        for leaf_hash in self.removed_leaves {
+            store.remove_leaf(&leaf_hash).await?;
+        }
+        for node in self.removed_branches {
+            store.remove_branch(&node).await?;
+        }
+        Ok(())
+    }
+}